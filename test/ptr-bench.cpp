@@ -0,0 +1,371 @@
+/*
+ptr-bench - compares the former copying conv_type_domain with the
+single pass one in zconf.cpp, on synthesized _services._dns-sd._udp PTR rdata
+
+standalone, build and run with
+	g++ -O2 -o ptr-bench ptr-bench.cpp && ./ptr-bench [rounds]
+
+the new version is a copy of conv_type_domain (and conv_label) in zconf.cpp,
+keep them in sync
+*/
+
+#include <string>
+#include <vector>
+#include <cstring>
+#include <cstdio>
+#include <cstdlib>
+#include <ctime>
+#include <stdint.h>
+
+#define MAX_DOMAIN_LABEL 63
+#define MAX_DOMAIN_NAME 255
+
+// as in dns_sd.h
+#define kDNSServiceMaxDomainName 1009
+
+#define FLEXT_ASSERT(b) ((void)0)
+
+namespace old {
+
+// conv_type_domain and its helpers before the single pass version, as they were in zconf.cpp
+
+typedef struct { unsigned char c[ 64]; } domainlabel;      // One label: length byte and up to 63 characters.
+typedef struct { unsigned char c[256]; } domainname;       // Up to 255 bytes of length-prefixed domainlabels.
+
+static char *conv_label2str(const domainlabel *const label, char *ptr)
+{
+	FLEXT_ASSERT(label != NULL);
+	FLEXT_ASSERT(ptr   != NULL);
+
+	const unsigned char *      src = label->c;      // Domain label we're reading.
+	const unsigned char        len = *src++;        // Read length of this (non-null) label.
+	const unsigned char *const end = src + len;     // Work out where the label ends.
+
+	if (len > MAX_DOMAIN_LABEL) return(NULL);       // If illegal label, abort.
+	while (src < end) {                             // While we have characters in the label.
+		unsigned char c = *src++;
+		if (c == '.' || c == '\\')                  // If character is a dot or the escape character
+			*ptr++ = '\\';                          // Output escape character.
+		else if (c <= ' ') {                        // If non-printing ascii, output decimal escape sequence.
+			*ptr++ = '\\';
+			*ptr++ = (char)  ('0' + (c / 100)     );
+			*ptr++ = (char)  ('0' + (c /  10) % 10);
+			c      = (unsigned char)('0' + (c      ) % 10);
+		}
+		*ptr++ = (char)c;                           // Copy the character.
+	}
+	*ptr = 0;                                       // Null-terminate the string
+	return(ptr);                                    // and return.
+}
+
+static char *conv_domain2str(const domainname *const name, char *ptr)
+{
+	FLEXT_ASSERT(name != NULL);
+	FLEXT_ASSERT(ptr  != NULL);
+
+	const unsigned char *src         = name->c;                     // Domain name we're reading.
+	const unsigned char *const max   = name->c + MAX_DOMAIN_NAME;   // Maximum that's valid.
+
+	if (*src == 0) *ptr++ = '.';                                    // Special case: For root, just write a dot.
+
+	while (*src) {                                                  // While more characters in the domain name.
+		if (src + 1 + *src >= max) return(NULL);
+		ptr = conv_label2str((const domainlabel *)src, ptr);
+		if (!ptr) return(NULL);
+		src += 1 + *src;
+		*ptr++ = '.';                                               // Write the dot after the label.
+	}
+
+	*ptr++ = 0;                                                     // Null-terminate the string
+	return(ptr);                                                    // and return.
+}
+
+static bool conv_type_domain(const void * rdata, uint16_t rdlen, char * type, char * domain)
+{
+	unsigned char *cursor;
+	unsigned char *start;
+	unsigned char *end;
+
+	FLEXT_ASSERT(rdata  != NULL);
+	FLEXT_ASSERT(rdlen  != 0);
+	FLEXT_ASSERT(type   != NULL);
+	FLEXT_ASSERT(domain != NULL);
+
+	start = new unsigned char[rdlen];
+	FLEXT_ASSERT(start != NULL);
+	memcpy(start, rdata, rdlen);
+
+	end = start + rdlen;
+	cursor = start;
+	if ((*cursor == 0) || (*cursor >= 64)) goto exitWithError;
+	cursor += 1 + *cursor;                                       // Move to the start of the second DNS label.
+	if (cursor >= end) goto exitWithError;
+	if ((*cursor == 0) || (*cursor >= 64)) goto exitWithError;
+	cursor += 1 + *cursor;                                       // Move to the start of the thrid DNS label.
+	if (cursor >= end) goto exitWithError;
+
+	/* Take everything from start of third DNS label until end of DNS name and call that the "domain". */
+	if (conv_domain2str((const domainname *)cursor, domain) == NULL) goto exitWithError;
+	*cursor = 0;                                                 // Set the length byte of the third label to zero.
+
+	/* Take the first two DNS labels and call that the "type". */
+	if (conv_domain2str((const domainname *)start, type) == NULL) goto exitWithError;
+	delete[] start;
+	return true;
+
+exitWithError:
+	delete[] start;
+	return false;
+}
+
+} // namespace old
+
+namespace cur {
+
+// Append one label of len characters at src to ptr, escaped like DNSServiceConstructFullName does,
+// followed by a dot. Returns the new end or NULL if this plus the terminator doesn't fit below end.
+static char *conv_label(const unsigned char *src, int len, char *ptr, const char *end)
+{
+	const unsigned char *const lend = src + len;
+	if (end - ptr >= 4 * len + 2) {                 // Room for the worst case, no checks needed.
+		for (; src < lend; ++src) {
+			unsigned char c = *src;
+			if (c > ' ' && c != '.' && c != '\\')
+				*ptr++ = (char)c;                   // Plain character, the common case.
+			else if (c > ' ') {                     // Dot or the escape character, output escape character.
+				*ptr++ = '\\';
+				*ptr++ = (char)c;
+			}
+			else {                                  // Non-printing ascii, output decimal escape sequence.
+				*ptr++ = '\\';
+				*ptr++ = (char)('0' + (c / 100)     );
+				*ptr++ = (char)('0' + (c /  10) % 10);
+				*ptr++ = (char)('0' + (c      ) % 10);
+			}
+		}
+		*ptr++ = '.';
+		return(ptr);
+	}
+	for (; src < lend; ++src) {                     // Close to the end, check each character.
+		unsigned char c = *src;
+		if (c == '.' || c == '\\') {                // If character is a dot or the escape character
+			if (end - ptr < 4) return(NULL);
+			*ptr++ = '\\';                          // output escape character.
+		}
+		else if (c <= ' ') {                        // If non-printing ascii, output decimal escape sequence.
+			if (end - ptr < 6) return(NULL);
+			*ptr++ = '\\';
+			*ptr++ = (char)  ('0' + (c / 100)     );
+			*ptr++ = (char)  ('0' + (c /  10) % 10);
+			c      = (unsigned char)('0' + (c      ) % 10);
+		}
+		else if (end - ptr < 3) return(NULL);
+		*ptr++ = (char)c;                           // Copy the character.
+	}
+	*ptr++ = '.';                                   // Write the dot after the label.
+	return(ptr);
+}
+
+static bool conv_type_domain(const void *rdata, uint16_t rdlen, char *type, size_t typelen, char *domain, size_t domainlen)
+{
+	FLEXT_ASSERT(rdata  != NULL);
+	FLEXT_ASSERT(type   != NULL && typelen   > 0);
+	FLEXT_ASSERT(domain != NULL && domainlen > 0);
+
+	// The first two labels are the "type", everything after that is the "domain".
+	// Single pass over the rdata, nothing is copied.
+	const unsigned char *src = (const unsigned char *)rdata;
+	const unsigned char *const end = src + rdlen;
+	char *ptr = type;
+	const char *pend = type + typelen;
+	int labels = 0;
+
+	*type = *domain = 0;
+
+	for (;;) {
+		if (src >= end) return false;                            // Name isn't terminated within rdata.
+		const int len = *src++;
+		if (!len) break;                                         // Root label, done.
+		if (len > MAX_DOMAIN_LABEL || len > end - src) return false;
+
+		if (labels++ == 2) {                                     // Start of the third label, switch to the domain.
+			*ptr = 0;
+			ptr = domain;
+			pend = domain + domainlen;
+		}
+		ptr = conv_label(src, len, ptr, pend);
+		if (!ptr) return false;
+		src += len;
+	}
+
+	if (labels < 2) return false;
+	if (labels == 2) {                                           // Special case: For root, just write a dot.
+		*ptr = 0;
+		ptr = domain;
+		if (domainlen < 2) return false;
+		*ptr++ = '.';
+	}
+	*ptr = 0;                                                    // Null-terminate the string.
+	return true;
+}
+
+} // namespace cur
+
+typedef std::vector<unsigned char> Rdata;
+
+// wire format of a name, labels separated by |
+static Rdata Name(const char *labels,bool terminate = true)
+{
+	Rdata r;
+	for(const char *c = labels; *c; ) {
+		const char *e = strchr(c,'|');
+		size_t n = e?e-c:strlen(c);
+		r.push_back((unsigned char)n);
+		r.insert(r.end(),c,c+n);
+		c += n;
+		if(*c) ++c;
+	}
+	if(terminate) r.push_back(0);
+	return r;
+}
+
+// a label of n times ch
+static std::string Label(int n,char ch = 'x')
+{
+	return std::string(n,ch);
+}
+
+struct Record
+{
+	Record(const Rdata &r,bool ok,const char *t = "",const char *d = ""): rdata(r),valid(ok),type(t),domain(d) {}
+
+	Rdata rdata;
+	bool valid;
+	std::string type,domain;
+};
+
+// both have to agree on these
+static std::vector<Record> Common()
+{
+	std::vector<Record> r;
+	// typical burst
+	r.push_back(Record(Name("_http|_tcp|local"),true,"_http._tcp.","local."));
+	r.push_back(Record(Name("_osc|_udp|local"),true,"_osc._udp.","local."));
+	r.push_back(Record(Name("_ssh|_tcp|local"),true,"_ssh._tcp.","local."));
+	r.push_back(Record(Name("_sftp-ssh|_tcp|local"),true,"_sftp-ssh._tcp.","local."));
+	r.push_back(Record(Name("_airplay|_tcp|local"),true,"_airplay._tcp.","local."));
+	r.push_back(Record(Name("_raop|_tcp|local"),true,"_raop._tcp.","local."));
+	r.push_back(Record(Name("_ipp|_tcp|local"),true,"_ipp._tcp.","local."));
+	r.push_back(Record(Name("_printer|_tcp|local"),true,"_printer._tcp.","local."));
+	r.push_back(Record(Name("_googlecast|_tcp|local"),true,"_googlecast._tcp.","local."));
+	r.push_back(Record(Name("_companion-link|_tcp|local"),true,"_companion-link._tcp.","local."));
+	r.push_back(Record(Name("_http|_tcp|studio|example|org"),true,"_http._tcp.","studio.example.org."));
+	// root domain
+	r.push_back(Record(Name("_http|_tcp"),true,"_http._tcp.","."));
+	// escaped characters
+	r.push_back(Record(Name("_a.b|_tcp|local"),true,"_a\\.b._tcp.","local."));
+	r.push_back(Record(Name("_x y|_udp|my\\net|local"),true,"_x\\032y._udp.","my\\\\net.local."));
+	// longest labels
+	std::string l63 = Label(63);
+	r.push_back(Record(Name((l63+"|"+l63+"|"+l63+"|"+l63).c_str()),true,(l63+"."+l63+".").c_str(),(l63+"."+l63+".").c_str()));
+
+	// rejected by both, without reading beyond the rdata
+	std::string l64 = Label(64);
+	r.push_back(Record(Name((l64+"|_tcp|local").c_str()),false)); // over-long first label
+	r.push_back(Record(Name(("_http|"+l64+"|local").c_str()),false)); // over-long second label
+	r.push_back(Record(Name(("_http|_tcp|"+l64).c_str()),false)); // over-long domain label
+	r.push_back(Record(Name(""),false)); // empty name
+	r.push_back(Record(Name("_http"),false)); // one label only
+	r.push_back(Record(Name("_http|_tcp",false),false)); // nothing after the type
+
+	Rdata l = Name("_http|_tcp|local");
+	l[0] = 200; // label length byte beyond the end
+	r.push_back(Record(l,false));
+
+	Rdata p = Name("_http|_tcp|local");
+	p[11] = 0xc0; // compression pointer, not allowed in rdata of the meta query
+	r.push_back(Record(p,false));
+
+	// name far over 255 bytes, escaped it wouldn't even fit the output buffers of the meta callback
+	std::string c63 = Label(63,'\001');
+	std::string dom;
+	for(int i = 0; i < 4; ++i) dom += "|"+c63;
+	r.push_back(Record(Name(("_http|_tcp"+dom+dom+dom+dom+dom).c_str()),false));
+	return r;
+}
+
+// the old parser reads beyond the rdata on these, so only the new one is run
+static std::vector<Record> Overrunning()
+{
+	std::vector<Record> r;
+	r.push_back(Record(Name("_http|_tcp|local",false),false)); // not terminated
+
+	Rdata t = Name("_http|_tcp|local");
+	t.resize(t.size()-3);
+	r.push_back(Record(t,false)); // label running past the end
+	return r;
+}
+
+static double Seconds()
+{
+	return (double)clock()/CLOCKS_PER_SEC;
+}
+
+static bool Check(const char *what,const Record &r,bool ok,const char *type,const char *domain)
+{
+	if(ok != r.valid || (ok && (r.type != type || r.domain != domain))) {
+		fprintf(stderr,"%s: record %s: got %s \"%s\" \"%s\"\n",what,r.valid?r.type.c_str():"(malformed)",ok?"valid":"invalid",type,domain);
+		return false;
+	}
+	return true;
+}
+
+int main(int argc,char *argv[])
+{
+	int rounds = argc > 1?atoi(argv[1]):200000;
+	if(rounds < 1) rounds = 1;
+
+	// as in the meta callback
+	char type[kDNSServiceMaxDomainName],domain[kDNSServiceMaxDomainName];
+
+	std::vector<Record> good = Common(),bad = Overrunning();
+
+	bool passed = true;
+	for(size_t i = 0; i < good.size(); ++i) {
+		const Record &r = good[i];
+		passed = Check("old",r,old::conv_type_domain(&r.rdata[0],(uint16_t)r.rdata.size(),type,domain),type,domain) && passed;
+		passed = Check("new",r,cur::conv_type_domain(&r.rdata[0],(uint16_t)r.rdata.size(),type,sizeof type,domain,sizeof domain),type,domain) && passed;
+	}
+	for(size_t i = 0; i < bad.size(); ++i) {
+		const Record &r = bad[i];
+		passed = Check("new",r,cur::conv_type_domain(&r.rdata[0],(uint16_t)r.rdata.size(),type,sizeof type,domain,sizeof domain),type,domain) && passed;
+	}
+	if(!passed) return 1;
+
+	// timed on the valid records, as in a burst of meta query answers
+	std::vector<Rdata> burst;
+	for(size_t i = 0; i < good.size(); ++i)
+		if(good[i].valid) burst.push_back(good[i].rdata);
+
+	// the valid results are counted, so that the calls can't be optimized away
+	long cnt = 0;
+
+	double t = Seconds();
+	for(int n = 0; n < rounds; ++n)
+		for(size_t i = 0; i < burst.size(); ++i)
+			cnt += old::conv_type_domain(&burst[i][0],(uint16_t)burst[i].size(),type,domain);
+	double told = Seconds()-t;
+
+	t = Seconds();
+	for(int n = 0; n < rounds; ++n)
+		for(size_t i = 0; i < burst.size(); ++i)
+			cnt -= cur::conv_type_domain(&burst[i][0],(uint16_t)burst[i].size(),type,sizeof type,domain,sizeof domain);
+	double tnew = Seconds()-t;
+
+	double calls = (double)rounds*burst.size();
+	printf("%d records checked (%d with the new parser only), %d valid ones timed, %d rounds\n",(int)(good.size()+bad.size()),(int)bad.size(),(int)burst.size(),rounds);
+	printf("copying:     %.1f ns per record\n",told/calls*1.e9);
+	printf("single pass: %.1f ns per record\n",tnew/calls*1.e9);
+	printf("speedup:     %.1fx\n",tnew > 0?told/tnew:0.);
+	return cnt == 0?0:1;
+}
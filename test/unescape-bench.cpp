@@ -0,0 +1,177 @@
+/*
+unescape-bench - compares the former std::string based DNSUnescape
+with the buffer based one in zconf.cpp, on typical service names
+
+standalone, build and run with
+	g++ -O2 -o unescape-bench unescape-bench.cpp && ./unescape-bench [rounds]
+
+the new version is a copy of DNSUnescape (and its DigitTable) in zconf.cpp,
+keep them in sync
+*/
+
+#include <string>
+#include <cstring>
+#include <cstdio>
+#include <cstdlib>
+#include <ctime>
+
+#ifndef LIKELY
+#define LIKELY(x) (x)
+#define UNLIKELY(x) (x)
+#endif
+
+// DNSUnescape before the buffer version, as it was in zconf.cpp
+static std::string OldUnescape(const char *txt)
+{
+	std::string ret;
+	const char *c = txt;
+	bool esc = false;
+	while(*c) {
+		if(esc) {
+			if(*c >= '0' && *c <= '9') {
+				// decimal code
+				int d = (*c++)-'0';
+				d = d*10+(*c++)-'0';
+				d = d*10+(*c++)-'0';
+				ret += (char)(unsigned char)d;
+			}
+			else
+				// escaped special char (like .)
+				ret += *(c++);
+			esc = false;
+		}
+		else if(*c == '\\') {
+			esc = true;
+			c++;
+		}
+		else
+			ret += *(c++);
+	}
+	return ret;
+}
+
+// decimal values of the digit characters, for unescaping
+class DigitTable
+{
+public:
+	enum { nodigit = 0xff };
+
+	DigitTable()
+	{
+		for(int c = 0; c < 256; ++c)
+			val[c] = c >= '0' && c <= '9'?(unsigned char)(c-'0'):(unsigned char)nodigit;
+	}
+
+	unsigned char val[256];
+};
+
+static const DigitTable digits;
+
+static const char *NewUnescape(const char *txt,char *buf,size_t len)
+{
+	// fast path: nothing to unescape (strchr is vectorized by the C library)
+	const char *c = strchr(txt,'\\');
+	if(LIKELY(!c) || UNLIKELY(!len)) return txt;
+
+	size_t n = c-txt;
+	if(n >= len) n = len-1;
+	memcpy(buf,txt,n);
+
+	const unsigned char *val = digits.val;
+	char *d = buf+n,*end = buf+len-1; // room for termination
+	while(*c && d < end) {
+		if(*c != '\\') {
+			// plain run up to the next escape
+			const char *e = strchr(c,'\\');
+			size_t k = e?e-c:strlen(c);
+			if(k > (size_t)(end-d)) k = end-d;
+			memcpy(d,c,k);
+			d += k,c += k;
+			continue;
+		}
+
+		const unsigned char *u = (const unsigned char *)c+1;
+		unsigned int d0,d1,d2;
+		if((d0 = val[u[0]]) <= 9 && (d1 = val[u[1]]) <= 9 && (d2 = val[u[2]]) <= 9) {
+			// decimal code
+			*d++ = (char)(unsigned char)(d0*100+d1*10+d2);
+			c += 4;
+		}
+		else if(u[0]) {
+			// escaped special char (like .)
+			*d++ = (char)u[0];
+			c += 2;
+		}
+		else
+			// dangling escape
+			++c;
+	}
+	*d = 0;
+	return buf;
+}
+
+// as seen in browse, resolve, meta and domains callbacks
+// most names need no unescaping, some have escaped spaces, dots or UTF-8
+static const char *const names[] = {
+	"local.",
+	"_osc._udp",
+	"_http._tcp",
+	"_ssh._tcp",
+	"Living Room",
+	"Kitchen Speaker",
+	"pd-studio-4",
+	"MacBook-Pro-von-Anna",
+	"Living\\032Room.local.",
+	"Bob\\226\\128\\153s MacBook Pro",
+	"HP LaserJet 400 M401dn \\(5A2B1C\\)",
+	"Office\\.Printer",
+	"rack-07\\.stage\\.venue",
+	"Caf\\195\\169 Zeroconf Test\\032Host",
+	NULL
+};
+
+static double Seconds()
+{
+	return (double)clock()/CLOCKS_PER_SEC;
+}
+
+int main(int argc,char *argv[])
+{
+	int rounds = argc > 1?atoi(argv[1]):1000000;
+	if(rounds < 1) rounds = 1;
+
+	char buf[1009]; // kDNSServiceMaxDomainName
+
+	// both have to agree
+	int cnt = 0;
+	for(const char *const *n = names; *n; ++n,++cnt) {
+		std::string o = OldUnescape(*n);
+		const char *r = NewUnescape(*n,buf,sizeof buf);
+		if(o != r) {
+			fprintf(stderr,"mismatch for \"%s\": \"%s\" != \"%s\"\n",*n,o.c_str(),r);
+			return 1;
+		}
+	}
+
+	// the results are summed up, so that the calls can't be optimized away
+	size_t sum = 0;
+
+	double t = Seconds();
+	for(int i = 0; i < rounds; ++i)
+		for(const char *const *n = names; *n; ++n)
+			sum += OldUnescape(*n).length();
+	double told = Seconds()-t;
+
+	t = Seconds();
+	for(int i = 0; i < rounds; ++i)
+		for(const char *const *n = names; *n; ++n)
+			sum -= strlen(NewUnescape(*n,buf,sizeof buf));
+	double tnew = Seconds()-t;
+
+	double calls = (double)rounds*cnt;
+	printf("%d names, %d rounds\n",cnt,rounds);
+	printf("std::string: %.1f ns per name\n",told/calls*1.e9);
+	printf("buffer:      %.1f ns per name\n",tnew/calls*1.e9);
+	printf("speedup:     %.1fx\n",tnew > 0?told/tnew:0.);
+	return sum == 0?0:1;
+}
@@ -11,60 +11,238 @@ $LastChangedBy$
 */
 
 #include "zconf.h"
+#include <algorithm>
+
+#if FLEXT_OS == FLEXT_OS_LINUX
+	#include <sys/epoll.h>
+	#include <sys/eventfd.h>
+#elif FLEXT_OS != FLEXT_OS_WIN
+	#include <poll.h>
+	#include <fcntl.h>
+#endif
+
+#include <errno.h>
+#include <string.h>
+#include <stdio.h>
 
 #define ZCONF_VERSION "0.2.1"
 
 namespace zconf {
 
-// unescape a DNS-escaped string and make a symbol
+// decimal values of the digit characters, for unescaping
+class DigitTable
+{
+public:
+	enum { nodigit = 0xff };
+
+	DigitTable()
+	{
+		for(int c = 0; c < 256; ++c)
+			val[c] = c >= '0' && c <= '9'?(unsigned char)(c-'0'):(unsigned char)nodigit;
+	}
+
+	unsigned char val[256];
+};
+
+static const DigitTable digits;
+
+// unescape a DNS name
 // http://www.faqs.org/rfcs/rfc1035.html, section 5.1
-std::string DNSEscape(const char *txt,bool escdot)
+const char *DNSUnescape(const char *txt,char *buf,size_t len)
 {
-	std::string ret;
-	for(const char *c = txt; *c; ++c) {
-		// \TODO: here, the choice of characters to escape is tentative... look up which ones should be really escaped
-		if((*c >= 'a' && *c <= 'z') || (*c >= 'A' && *c <= 'Z') || (*c >= '0' && *c <= '9') || strchr("_-+",*c) || (!escdot && *c == '.'))
-			ret += *c;
+	// fast path: nothing to unescape (strchr is vectorized by the C library)
+	const char *c = strchr(txt,'\\');
+	if(LIKELY(!c) || UNLIKELY(!len)) return txt;
+
+	size_t n = c-txt;
+	if(n >= len) n = len-1;
+	memcpy(buf,txt,n);
+
+	const unsigned char *val = digits.val;
+	char *d = buf+n,*end = buf+len-1; // room for termination
+	while(*c && d < end) {
+		if(*c != '\\') {
+			// plain run up to the next escape
+			const char *e = strchr(c,'\\');
+			size_t k = e?e-c:strlen(c);
+			if(k > (size_t)(end-d)) k = end-d;
+			memcpy(d,c,k);
+			d += k,c += k;
+			continue;
+		}
+
+		const unsigned char *u = (const unsigned char *)c+1;
+		unsigned int d0,d1,d2;
+		if((d0 = val[u[0]]) <= 9 && (d1 = val[u[1]]) <= 9 && (d2 = val[u[2]]) <= 9) {
+			// decimal code
+			*d++ = (char)(unsigned char)(d0*100+d1*10+d2);
+			c += 4;
+		}
+		else if(u[0]) {
+			// escaped special char (like .)
+			*d++ = (char)u[0];
+			c += 2;
+		}
+		else
+			// dangling escape
+			++c;
+	}
+	*d = 0;
+	return buf;
+}
+
+StringTable stringtable;
+
+int StringTable::Acquire(const char *s)
+{
+	mtx.Lock();
+	int h;
+	std::map<std::string,int>::const_iterator it = index.find(s);
+	if(it != index.end()) {
+		h = it->second;
+		++refs[h-1];
+	}
+	else {
+		if(freed.empty()) {
+			strs.push_back(s);
+			refs.push_back(1);
+			h = (int)strs.size();
+		}
 		else {
-			ret += '\\';
-			if(strchr(".\\/!?=*#:;,&%()<>",*c))
-				ret += *c;
-			else {
-				int d = *c;
-				ret += (char)(unsigned char)(d/100);
-				ret += (char)(unsigned char)((d/10)%10);
-				ret += (char)(unsigned char)(d%10);
-			}
+			h = freed.front();
+			freed.pop_front();
+			strs[h-1] = s;
+			refs[h-1] = 1;
 		}
+		index[s] = h;
 	}
-	return ret;
+	mtx.Unlock();
+	return h;
 }
 
-std::string DNSUnescape(const char *txt)
+int StringTable::Find(const char *s) const
 {
-	std::string ret;
-	const char *c = txt;
-	bool esc = false;
-	while(*c) {
-		if(esc) {
-			if(*c >= '0' && *c <= '9') {
-				// decimal code
-				int d = (*c++)-'0';
-				d = d*10+(*c++)-'0';
-				d = d*10+(*c++)-'0';
-				ret += (char)(unsigned char)d;
-			}
-			else
-				// escaped special char (like .)
-				ret += *(c++);
-			esc = false;
+	mtx.Lock();
+	std::map<std::string,int>::const_iterator it = index.find(s);
+	int h = it != index.end()?it->second:0;
+	mtx.Unlock();
+	return h;
+}
+
+void StringTable::Release(int h)
+{
+	mtx.Lock();
+	if(h > 0 && h <= (int)refs.size() && refs[h-1] > 0 && !--refs[h-1]) {
+		index.erase(strs[h-1]);
+		std::string().swap(strs[h-1]);
+		freed.push_back(h);
+	}
+	mtx.Unlock();
+}
+
+bool StringTable::Lookup(int h,std::string &s) const
+{
+	mtx.Lock();
+	bool ok = h > 0 && h <= (int)refs.size() && refs[h-1] > 0;
+	if(ok) s = strs[h-1];
+	mtx.Unlock();
+	return ok;
+}
+
+HandleSet::~HandleSet()
+{
+	for(std::set<int>::const_iterator it = held.begin(); it != held.end(); ++it)
+		stringtable.Release(*it);
+}
+
+int HandleSet::Hold(const char *s)
+{
+	int h = stringtable.Acquire(s);
+	if(!held.insert(h).second) stringtable.Release(h);
+	return h;
+}
+
+SymbolCache::SymbolCache()
+{
+	for(int i = 0; i < size; ++i) {
+		entries[i].sym = NULL;
+		entries[i].raw[0] = 0;
+	}
+}
+
+Symbol SymbolCache::Get(const char *raw,bool unescape)
+{
+	// FNV-1a
+	unsigned int h = 2166136261u;
+	size_t len = 0;
+	for(const unsigned char *c = (const unsigned char *)raw; *c; ++c,++len)
+		h = (h^*c)*16777619u;
+	if(unescape) h = ~h;
+
+	char buf[kDNSServiceMaxDomainName];
+	if(UNLIKELY(len >= maxlen))
+		// too long to be cached
+		return MakeSymbol(unescape?DNSUnescape(raw,buf,sizeof buf):raw);
+
+	Entry &e = entries[(h^(h>>16))%size];
+	if(LIKELY(e.sym) && e.unescape == unescape && !memcmp(e.raw,raw,len+1))
+		return e.sym;
+
+	e.sym = MakeSymbol(unescape?DNSUnescape(raw,buf,sizeof buf):raw);
+	e.unescape = unescape;
+	memcpy(e.raw,raw,len+1);
+	return e.sym;
+}
+
+bool SetTxtRecord(TxtRecords &rec,Symbol key,int argc,const t_atom *argv)
+{
+	if(!argc) {
+		TxtRecords::iterator it = rec.find(key);
+		if(it == rec.end()) return false;
+		rec.erase(it);
+		return true;
+	}
+
+	std::string txt;
+	while(argc) {
+		if(flext::IsString(*argv)) {
+			txt += flext::GetString(*argv++);
+			--argc;
+			if(argc) txt += ' ';
 		}
-		else if(*c == '\\') {
-			esc = true;
-			c++;
+		else if(flext::CanbeFloat(*argv)) {
+			char num[32];
+			sprintf(num,"%g",flext::GetAFloat(*argv++));
+			--argc;
+			txt += num;
+			if(argc) txt += ' ';
 		}
 		else
-			ret += *(c++);
+			++argv,--argc;
+	}
+	rec[key] = txt;
+	return true;
+}
+
+std::string MakeTxtRecord(const TxtRecords &rec)
+{
+	std::string ret;
+	for(TxtRecords::const_iterator it = rec.begin(); it != rec.end(); ++it) {
+		const char *k = flext::GetString(it->first);
+		size_t len = strlen(k)+1+it->second.length();
+		if(len > 255) {
+			flext::post("txtrecord %s too long!",k);
+			continue;
+		}
+		// the daemon takes the record length as 16 bits
+		if(ret.length()+1+len > 65535) {
+			flext::post("txtrecord %s doesn't fit into the record!",k);
+			continue;
+		}
+		ret += (char)(unsigned char)len;
+		ret += k;
+		ret += '=';
+		ret += it->second;
 	}
 	return ret;
 }
@@ -74,123 +252,714 @@ std::string DNSUnescape(const char *txt)
 Worker::~Worker()
 {
 //    fprintf(stderr,"Destroy %p\n",this);
-	if(client) 
-		DNSServiceRefDeallocate(client);
+	Close();
+}
+
+// finalizer of MurmurHash3, every bit of k affects all bits of the result
+// (the low bits of addresses are always zero due to alignment)
+static unsigned int Mix(size_t k)
+{
+	unsigned int h = (unsigned int)k;
+	if(sizeof(k) > sizeof(h)) h ^= (unsigned int)((k >> 16) >> 16); // fold in the upper half
+	h ^= h >> 16;
+	h *= 0x85ebca6bu;
+	h ^= h >> 13;
+	h *= 0xc2b2ae35u;
+	h ^= h >> 16;
+	return h;
+}
+
+unsigned int Worker::Shard() const
+{
+	// spread workers without a key
+	return Mix((size_t)this);
+}
+
+unsigned int Worker::Hash(Symbol a,Symbol b)
+{
+	// symbols are unique, so their addresses will do
+	return Mix((size_t)a*31+(size_t)b);
 }
 
 bool Worker::Init()
 {
 //    fprintf(stderr,"Init %p\n",this);
-	fd = DNSServiceRefSockFD(client);
-	return fd >= 0;
+	if(conn && !ownconn) {
+		// subordinate operation, the shared connection is polled instead
+		fd = -1;
+		return true;
+	}
+	else {
+		fd = DNSServiceRefSockFD(conn?conn:client);
+		return fd >= 0;
+	}
+}
+
+void Worker::Close()
+{
+	// client still equals conn if the operation could not be created
+	if(client && client != conn) 
+		DNSServiceRefDeallocate(client);
+	client = NULL;
+
+	if(ownconn) {
+		DNSServiceRefDeallocate(conn);
+		ownconn = false;
+	}
+	conn = NULL;
+}
+
+DNSServiceFlags Worker::Share(bool subordinate)
+{
+	if(loop->connection) {
+		client = conn = loop->connection->client;
+		return kDNSServiceFlagsShareConnection;
+	}
+	else if(subordinate) {
+		DNSServiceErrorType err = DNSServiceCreateConnection(&conn);
+		if(LIKELY(err == kDNSServiceErr_NoError)) {
+			ownconn = true;
+			client = conn;
+			return kDNSServiceFlagsShareConnection;
+		}
+		else {
+			conn = NULL;
+			OnError(err);
+			return 0;
+		}
+	}
+	else
+		return 0;
+}
+
+MessageRing::MessageRing(int size)
+	: slots(NULL),mask(0),head(0),tail(0),killed(0)
+{
+	Resize(size);
+}
+
+MessageRing::~MessageRing()
+{
+	for(unsigned int i = 0; i <= mask; ++i)
+		delete[] slots[i].ext;
+	delete[] slots;
+}
+
+void MessageRing::Resize(int size)
+{
+	FLEXT_ASSERT(!Avail());
+
+	unsigned int sz = 1;
+	while(sz < (unsigned int)size) sz <<= 1;
+	if(slots && sz == mask+1) return;
+
+	if(slots) {
+		for(unsigned int i = 0; i <= mask; ++i)
+			delete[] slots[i].ext;
+		delete[] slots;
+	}
+
+	mask = sz-1;
+	slots = new Slot[sz];
+	for(unsigned int i = 0; i < sz; ++i) {
+		slots[i].ext = NULL;
+		slots[i].extsize = 0;
+	}
 }
 
+bool MessageRing::Put(const t_symbol *sym,int argc,const t_atom *argv,const HandleSetPtr &held)
+{
+	unsigned int t = tail.load();
+	if(t-head.load() > mask) return false;
+
+	Slot &slot = slots[t&mask];
+	slot.sym = sym;
+	slot.argc = argc;
+	slot.dead = false;
+	slot.held = held;
+
+	t_atom *dst;
+	if(LIKELY(argc <= inlineatoms))
+		dst = slot.atoms;
+	else {
+		// the slot is ours until tail is advanced
+		if(slot.extsize < argc) {
+			delete[] slot.ext;
+			slot.ext = new t_atom[slot.extsize = argc];
+		}
+		dst = slot.ext;
+	}
+	if(argc) memcpy(dst,argv,argc*sizeof(t_atom));
+
+	tail.store(t+1);
+	return true;
+}
+
+void Worker::Message(const t_symbol *sym,int argc,const t_atom *argv,const HandleSetPtr &held)
+{
+	if(UNLIKELY(tag)) {
+		tagged.resize(argc+1);
+		SetSymbol(tagged[0],tag);
+		if(argc) memcpy(&tagged[1],argv,argc*sizeof(t_atom));
+		argv = &tagged[0],++argc;
+	}
+
+	if(target) {
+		target->OnForward(this,sym,argc,argv);
+		return;
+	}
+
+	int cap = capacity;
+	if(UNLIKELY(cap) && Waiting() >= cap && !Overflow(sym,argc,argv))
+		return;
+
+	// keep the order, backlogged messages go first
+	if(UNLIKELY(backlogged) && !Flush())
+		backlog.push_back(Backlogged(sym,argc,argv,held)),++backlogged;
+	else if(UNLIKELY(!messages.Put(sym,argc,argv,held))) {
+		backlog.push_back(Backlogged(sym,argc,argv,held)),++backlogged;
+		// the ring might have been emptied meanwhile
+		Flush();
+	}
+	++produced;
+	Signal();
+}
+
+int Worker::Missed()
+{
+	// the waiting messages are always the most recently produced ones
+	unsigned int p = produced;
+	int n = (int)(p-counted),w = Waiting();
+	counted = p;
+	return n < w?n:w;
+}
+
+bool Worker::Flush()
+{
+	while(!backlog.empty()) {
+		const Backlogged &msg = backlog.front();
+		if(!messages.Put(msg.Header(),msg.Count(),msg.Atoms(),msg.held)) return false;
+		backlog.pop_front(),--backlogged;
+	}
+	return true;
+}
+
+// add and remove messages for the same record only differ in the trailing more_coming flag
+static bool SameRecord(int cnt,const t_atom *atoms,int argc,const t_atom *argv)
+{
+	if(cnt != argc) return false;
+	for(int i = 0; i < argc-1; ++i) {
+		const t_atom &a = atoms[i],&b = argv[i];
+		if(flext::IsSymbol(a)) {
+			if(!flext::IsSymbol(b) || flext::GetSymbol(a) != flext::GetSymbol(b)) return false;
+		}
+		else if(!flext::CanbeFloat(b) || flext::GetAFloat(a) != flext::GetAFloat(b)) 
+			return false;
+	}
+	return true;
+}
+
+bool Worker::Overflow(const t_symbol *sym,int argc,const t_atom *argv)
+{
+	switch(policy) {
+		case overflow_coalesce:
+			if(sym == sym_remove) {
+				// look for the add of the record, most probably a recent one
+				for(std::deque<Backlogged>::iterator it = backlog.end(); it != backlog.begin(); ) {
+					--it;
+					if(it->Header() == sym_add && SameRecord(it->Count(),it->Atoms(),argc,argv)) {
+						backlog.erase(it),--backlogged;
+						coalesced += 2;
+						return false;
+					}
+				}
+
+				// then in the ring, unless the main thread has taken it meanwhile
+				for(unsigned int ix = messages.End(),begin = messages.Begin(); ix != begin; ) {
+					const MessageRing::Slot &s = messages[--ix];
+					if(s.sym == sym_add && SameRecord(s.argc,s.Atoms(),argc,argv) && messages.Kill(ix)) {
+						coalesced += 2;
+						return false;
+					}
+				}
+			}
+			// fall through
+		case overflow_dropoldest: {
+			// the oldest messages are in the ring, unless they have all been taken or discarded
+			unsigned int end = messages.End();
+			if((int)(scan-messages.Begin()) < 0) scan = messages.Begin();
+			for(; scan != end; ++scan)
+				if(messages.Kill(scan)) {
+					++scan,++dropped;
+					return true;
+				}
+
+			if(!backlog.empty()) {
+				backlog.pop_front(),--backlogged;
+				++dropped;
+			}
+			return true;
+		}
+		default:
+			++dropped;
+			return false;
+	}
+}
 
-char *Worker::conv_label2str(const domainlabel *const label, char *ptr)
+//! The shared connection to the daemon
+class Connection
+	: public Worker
 {
-	FLEXT_ASSERT(label != NULL);
-	FLEXT_ASSERT(ptr   != NULL);
-	
-	const unsigned char *      src = label->c;      // Domain label we're reading.
-	const unsigned char        len = *src++;        // Read length of this (non-null) label.
-	const unsigned char *const end = src + len;     // Work out where the label ends.
-	
-	if (len > MAX_DOMAIN_LABEL) return(NULL);       // If illegal label, abort.
-	while (src < end) {                             // While we have characters in the label.
-		unsigned char c = *src++;
-		if (c == '.' || c == '\\')                  // If character is a dot or the escape character
-			*ptr++ = '\\';                          // Output escape character.
+protected:
+	virtual bool Init()
+	{
+		DNSServiceErrorType err = DNSServiceCreateConnection(&client);
+		if(LIKELY(err == kDNSServiceErr_NoError)) {
+			FLEXT_ASSERT(client);
+			return Worker::Init();
+		}
+		else {
+			post("zconf - could not connect to daemon: %i",err);
+			return false;
+		}
+	}
+};
+
+
+// Append one label of len characters at src to ptr, escaped like DNSServiceConstructFullName does,
+// followed by a dot. Returns the new end or NULL if this plus the terminator doesn't fit below end.
+static char *conv_label(const unsigned char *src, int len, char *ptr, const char *end)
+{
+	const unsigned char *const lend = src + len;
+	if (end - ptr >= 4 * len + 2) {                 // Room for the worst case, no checks needed.
+		for (; src < lend; ++src) {
+			unsigned char c = *src;
+			if (c > ' ' && c != '.' && c != '\\')
+				*ptr++ = (char)c;                   // Plain character, the common case.
+			else if (c > ' ') {                     // Dot or the escape character, output escape character.
+				*ptr++ = '\\';
+				*ptr++ = (char)c;
+			}
+			else {                                  // Non-printing ascii, output decimal escape sequence.
+				*ptr++ = '\\';
+				*ptr++ = (char)('0' + (c / 100)     );
+				*ptr++ = (char)('0' + (c /  10) % 10);
+				*ptr++ = (char)('0' + (c      ) % 10);
+			}
+		}
+		*ptr++ = '.';
+		return(ptr);
+	}
+	for (; src < lend; ++src) {                     // Close to the end, check each character.
+		unsigned char c = *src;
+		if (c == '.' || c == '\\') {                // If character is a dot or the escape character
+			if (end - ptr < 4) return(NULL);
+			*ptr++ = '\\';                          // output escape character.
+		}
 		else if (c <= ' ') {                        // If non-printing ascii, output decimal escape sequence.
+			if (end - ptr < 6) return(NULL);
 			*ptr++ = '\\';
 			*ptr++ = (char)  ('0' + (c / 100)     );
 			*ptr++ = (char)  ('0' + (c /  10) % 10);
 			c      = (unsigned char)('0' + (c      ) % 10);
 		}
+		else if (end - ptr < 3) return(NULL);
 		*ptr++ = (char)c;                           // Copy the character.
 	}
-	*ptr = 0;                                       // Null-terminate the string
-	return(ptr);                                    // and return.
+	*ptr++ = '.';                                   // Write the dot after the label.
+	return(ptr);
 }
 
-char *Worker::conv_domain2str(const domainname *const name, char *ptr)
+bool Worker::conv_type_domain(const void *rdata, uint16_t rdlen, char *type, size_t typelen, char *domain, size_t domainlen)
 {
-	FLEXT_ASSERT(name != NULL);
-	FLEXT_ASSERT(ptr  != NULL);
+	FLEXT_ASSERT(rdata  != NULL);
+	FLEXT_ASSERT(type   != NULL && typelen   > 0);
+	FLEXT_ASSERT(domain != NULL && domainlen > 0);
+
+	// The first two labels are the "type", everything after that is the "domain".
+	// Single pass over the rdata, nothing is copied.
+	const unsigned char *src = (const unsigned char *)rdata;
+	const unsigned char *const end = src + rdlen;
+	char *ptr = type;
+	const char *pend = type + typelen;
+	int labels = 0;
 
-	const unsigned char *src         = name->c;                     // Domain name we're reading.
-	const unsigned char *const max   = name->c + MAX_DOMAIN_NAME;   // Maximum that's valid.
+	*type = *domain = 0;
 
-	if (*src == 0) *ptr++ = '.';                                    // Special case: For root, just write a dot.
+	for (;;) {
+		if (src >= end) return false;                            // Name isn't terminated within rdata.
+		const int len = *src++;
+		if (!len) break;                                         // Root label, done.
+		if (len > MAX_DOMAIN_LABEL || len > end - src) return false;
 
-	while (*src) {                                                  // While more characters in the domain name.
-		if (src + 1 + *src >= max) return(NULL);
-		ptr = conv_label2str((const domainlabel *)src, ptr);
-		if (!ptr) return(NULL);
-		src += 1 + *src;
-		*ptr++ = '.';                                               // Write the dot after the label.
+		if (labels++ == 2) {                                     // Start of the third label, switch to the domain.
+			*ptr = 0;
+			ptr = domain;
+			pend = domain + domainlen;
+		}
+		ptr = conv_label(src, len, ptr, pend);
+		if (!ptr) return false;
+		src += len;
 	}
 
-	*ptr++ = 0;                                                     // Null-terminate the string
-	return(ptr);                                                    // and return.
+	if (labels < 2) return false;
+	if (labels == 2) {                                           // Special case: For root, just write a dot.
+		*ptr = 0;
+		ptr = domain;
+		if (domainlen < 2) return false;
+		*ptr++ = '.';
+	}
+	*ptr = 0;                                                    // Null-terminate the string.
+	return true;
 }
 
-bool Worker::conv_type_domain(const void * rdata, uint16_t rdlen, char * type, char * domain)
+////////////////////////////////////////////////
+
+Symbol Worker::sym_error,Worker::sym_add,Worker::sym_remove,Worker::sym_batch;
+static Symbol sym_lookup;
+
+// I/O multiplexing for the worker thread
+// Workers stay registered from Init until they are retired,
+// Wait only reports the workers that are actually readable.
+class Poller
+	: public flext
 {
-	unsigned char *cursor;
-	unsigned char *start;
-	unsigned char *end;
+public:
+	Poller();
+	~Poller();
 
-	FLEXT_ASSERT(rdata  != NULL);
-	FLEXT_ASSERT(rdlen  != 0);
-	FLEXT_ASSERT(type   != NULL);
-	FLEXT_ASSERT(domain != NULL);
-
-	start = new unsigned char[rdlen];
-	FLEXT_ASSERT(start != NULL);
-	memcpy(start, rdata, rdlen);
-
-	end = start + rdlen;
-	cursor = start;
-	if ((*cursor == 0) || (*cursor >= 64)) goto exitWithError;
-	cursor += 1 + *cursor;                                       // Move to the start of the second DNS label.
-	if (cursor >= end) goto exitWithError;
-	if ((*cursor == 0) || (*cursor >= 64)) goto exitWithError;
-	cursor += 1 + *cursor;                                       // Move to the start of the thrid DNS label.
-	if (cursor >= end) goto exitWithError;
-	
-	/* Take everything from start of third DNS label until end of DNS name and call that the "domain". */
-	if (conv_domain2str((const domainname *)cursor, domain) == NULL) goto exitWithError;
-	*cursor = 0;                                                 // Set the length byte of the third label to zero.
-
-	/* Take the first two DNS labels and call that the "type". */
-	if (conv_domain2str((const domainname *)start, type) == NULL) goto exitWithError;
-	delete[] start;
+	bool Add(Worker *w);
+	void Remove(Worker *w);
+
+	// block until workers are readable, we are woken up or timeout (in ms, -1 for none) has passed
+	// returns the number of ready workers
+	int Wait(Worker **ready,int maxready,int timeout);
+
+	// can be called from any thread
+	void Wake();
+
+private:
+#if FLEXT_OS == FLEXT_OS_LINUX
+	int pollfd,wakefd;
+#else
+	// registered workers, a worker's pollix is its index
+	std::vector<Worker *> workers;
+#if FLEXT_OS == FLEXT_OS_WIN
+	// all sockets signal the same event, so there's no limit on their number
+	WSAEVENT sockevent;
+	HANDLE wakeevent;
+#else
+	std::vector<pollfd> fds;
+	int wakepipe[2];
+#endif
+#endif
+};
+
+#if FLEXT_OS == FLEXT_OS_LINUX
+
+Poller::Poller()
+{
+	pollfd = epoll_create(1);
+	wakefd = eventfd(0,EFD_NONBLOCK);
+	FLEXT_ASSERT(pollfd >= 0 && wakefd >= 0);
+
+	epoll_event ev;
+	ev.events = EPOLLIN;
+	ev.data.ptr = NULL; // marks the wakeup event
+	epoll_ctl(pollfd,EPOLL_CTL_ADD,wakefd,&ev);
+}
+
+Poller::~Poller()
+{
+	close(wakefd);
+	close(pollfd);
+}
+
+bool Poller::Add(Worker *w)
+{
+	epoll_event ev;
+	ev.events = EPOLLIN;
+	ev.data.ptr = w;
+	if(LIKELY(epoll_ctl(pollfd,EPOLL_CTL_ADD,w->fd,&ev) == 0))
+		return true;
+	else {
+		post("zconf - could not register worker: %s",strerror(errno));
+		return false;
+	}
+}
+
+void Poller::Remove(Worker *w)
+{
+	epoll_ctl(pollfd,EPOLL_CTL_DEL,w->fd,NULL);
+}
+
+int Poller::Wait(Worker **ready,int maxready,int timeout)
+{
+	const int maxevents = 64;
+	epoll_event events[maxevents];
+
+	int result = epoll_wait(pollfd,events,maxready < maxevents?maxready:maxevents,timeout);
+
+	int cnt = 0;
+	for(int i = 0; i < result; ++i) {
+		Worker *w = (Worker *)events[i].data.ptr;
+		if(w)
+			ready[cnt++] = w;
+		else {
+			// wakeup event
+			eventfd_t val;
+			eventfd_read(wakefd,&val);
+		}
+	}
+	return cnt;
+}
+
+void Poller::Wake()
+{
+	eventfd_write(wakefd,1);
+}
+
+#else // FLEXT_OS == FLEXT_OS_LINUX
+
+bool Poller::Add(Worker *w)
+{
+#if FLEXT_OS == FLEXT_OS_WIN
+	// this also makes the socket non-blocking, which the daemon client library copes with
+	if(UNLIKELY(WSAEventSelect((SOCKET)w->fd,sockevent,FD_READ|FD_CLOSE) != 0)) {
+		post("zconf - could not register worker: %i",WSAGetLastError());
+		return false;
+	}
+#endif
+	w->pollix = (int)workers.size();
+	workers.push_back(w);
+#if FLEXT_OS != FLEXT_OS_WIN
+	pollfd pfd;
+	pfd.fd = w->fd;
+	pfd.events = POLLIN;
+	pfd.revents = 0;
+	fds.push_back(pfd);
+#endif
 	return true;
+}
 
-exitWithError:
-	delete[] start;
-	return false;
+void Poller::Remove(Worker *w)
+{
+	int ix = w->pollix;
+	FLEXT_ASSERT(ix >= 0 && workers[ix] == w);
+
+	// move last worker into the vacant slot
+	workers[ix] = workers.back();
+	workers[ix]->pollix = ix;
+	workers.pop_back();
+#if FLEXT_OS == FLEXT_OS_WIN
+	WSAEventSelect((SOCKET)w->fd,NULL,0);
+	u_long nonblocking = 0;
+	ioctlsocket((SOCKET)w->fd,FIONBIO,&nonblocking);
+#else
+	fds[ix+1] = fds.back();
+	fds.pop_back();
+#endif
+	w->pollix = -1;
+}
+
+#if FLEXT_OS == FLEXT_OS_WIN
+
+Poller::Poller()
+{
+	sockevent = WSACreateEvent(); // manual reset
+	wakeevent = CreateEvent(NULL,FALSE,FALSE,NULL); // auto reset, a wakeup before the wait is kept
+	FLEXT_ASSERT(sockevent != WSA_INVALID_EVENT && wakeevent != NULL);
+}
+
+Poller::~Poller()
+{
+	WSACloseEvent(sockevent);
+	CloseHandle(wakeevent);
+}
+
+int Poller::Wait(Worker **ready,int maxready,int timeout)
+{
+	HANDLE events[2] = { wakeevent,sockevent };
+	DWORD result = WaitForMultipleObjects(2,events,FALSE,timeout < 0?INFINITE:(DWORD)timeout);
+	if(result != WAIT_OBJECT_0+1) return 0; // woken up or timed out
+
+	// reset before looking, so that events arriving meanwhile signal again
+	WSAResetEvent(sockevent);
+
+	int cnt = 0;
+	for(std::vector<Worker *>::const_iterator it = workers.begin(); it != workers.end(); ++it) {
+		if(cnt == maxready) {
+			// the rest is left for the next wait, their recorded events are still there
+			WSASetEvent(sockevent);
+			break;
+		}
+
+		// reading from the socket records FD_READ again if there's more data
+		WSANETWORKEVENTS ne;
+		if(WSAEnumNetworkEvents((SOCKET)(*it)->fd,NULL,&ne) == 0 && (ne.lNetworkEvents&(FD_READ|FD_CLOSE)))
+			ready[cnt++] = *it;
+	}
+	return cnt;
+}
+
+void Poller::Wake()
+{
+	SetEvent(wakeevent);
+}
+
+#else // FLEXT_OS == FLEXT_OS_WIN
+
+Poller::Poller()
+{
+	if(pipe(wakepipe) == 0) {
+		fcntl(wakepipe[0],F_SETFL,O_NONBLOCK);
+		fcntl(wakepipe[1],F_SETFL,O_NONBLOCK);
+	}
+	else
+		wakepipe[0] = wakepipe[1] = -1;
+
+	// slot 0 is the wakeup pipe
+	pollfd pfd;
+	pfd.fd = wakepipe[0];
+	pfd.events = POLLIN;
+	pfd.revents = 0;
+	fds.push_back(pfd);
+}
+
+Poller::~Poller()
+{
+	close(wakepipe[0]);
+	close(wakepipe[1]);
 }
 
+int Poller::Wait(Worker **ready,int maxready,int timeout)
+{
+	int result = poll(&fds[0],(nfds_t)fds.size(),timeout);
+	if(result <= 0) return 0;
+
+	if(fds[0].revents) {
+		char buf[64];
+		while(read(wakepipe[0],buf,sizeof buf) > 0) {}
+		--result;
+	}
+
+	int cnt = 0;
+	for(size_t i = 1; result > 0 && cnt < maxready && i < fds.size(); ++i)
+		if(fds[i].revents) {
+			ready[cnt++] = workers[i-1];
+			--result;
+		}
+	return cnt;
+}
+
+void Poller::Wake()
+{
+	char c = 0;
+	write(wakepipe[1],&c,1);
+}
+
+#endif // FLEXT_OS == FLEXT_OS_WIN
+#endif // FLEXT_OS == FLEXT_OS_LINUX
+
 ////////////////////////////////////////////////
 
-Symbol Worker::sym_error,Worker::sym_add,Worker::sym_remove;
+Loop **Base::loops = NULL;
+int Base::nloops = 0;
 
-Base::Workers *Base::newworkers = NULL;
-flext::ThrCond Base::cond;
+flext::ThrMutex Base::readymtx;
+std::vector<WorkerPtr> Base::readyworkers;
+std::deque<WorkerPtr> Base::dispatching;
 
-typedef std::set<Base *> ObjSet;
-static ObjSet objects;
+int Base::ringsize = 64;
+int Base::dispatchmsgs = 0;
+double Base::dispatchtime = 0;
+
+// upper bound for ring slots per worker
+static const int maxringsize = 65536;
+
+// at least one scheduler tick (64 samples at 32 kHz and above)
+const double Base::dispatchdelay = 0.002;
+
+#ifndef PD_DEVEL_VERSION
+static flext::Timer *idleclk = NULL;
+static Atomic<bool> scheduled(false);
+#endif
+
+std::vector<Base *> Base::pending;
 
 Base::Base() 
+	: deferred(0)
+	, capacity(0),overflow(overflow_dropnewest)
+	, dropped(0),coalesced(0)
+	, transaction(0),dirty(false)
 {
 	AddInAnything("messages");
-    objects.insert(this);
+}
+
+void Base::Defer()
+{
+	if(dirty) return;
+	dirty = true;
+
+	// within begin/commit the update is left to commit
+	if(!transaction) {
+		pending.push_back(this);
+#ifndef PD_DEVEL_VERSION
+		if(!scheduled.exchange(true)) idleclk->Delay(0);
+#endif
+	}
+}
+
+void Base::m_lookup(int argc,const t_atom *argv)
+{
+	for(int i = 0; i < argc; ++i) {
+		if(!CanbeInt(argv[i])) {
+			post("%s - lookup: handles must be ints",thisName());
+			continue;
+		}
+
+		int h = GetAInt(argv[i]);
+		std::string str;
+		t_atom at[2];
+		SetInt(at[0],h);
+		// unknown handles are output without string
+		bool ok = stringtable.Lookup(h,str);
+		if(ok) SetString(at[1],str.c_str());
+		ToOutAnything(GetOutAttr(),sym_lookup,ok?2:1,at);
+	}
+}
+
+void Base::m_commit()
+{
+	if(!transaction)
+		post("%s - commit without begin",thisName());
+	else if(!--transaction && dirty)
+		Apply();
+}
+
+void Base::ms_capacity(int c)
+{
+	if(c < 0)
+		post("%s - capacity must be >= 0 (0 for unlimited)",thisName());
+	else {
+		capacity = c;
+		if(worker) worker->capacity = c;
+	}
+}
+
+void Base::ms_overflow(int o)
+{
+	if(o < overflow_dropnewest || o > overflow_coalesce)
+		post("%s - overflow must be 0 (drop newest), 1 (drop oldest), 2 (coalesce add/remove)",thisName());
+	else {
+		overflow = o;
+		if(worker) worker->policy = o;
+	}
 }
 
 Base::~Base() 
 {
-    objects.erase(this);
+	if(dirty) pending.erase(std::remove(pending.begin(),pending.end(),this),pending.end());
 	Install(NULL);
 }
 
@@ -222,140 +991,475 @@ void Worker::OnError(DNSServiceErrorType error)
 		case kDNSServiceErr_NATTraversal: errtxt = "NATTraversal"; break;
 		case kDNSServiceErr_DoubleNAT: errtxt = "DoubleNAT"; break;
 		case kDNSServiceErr_BadTime: errtxt = "BadTime"; break;
+		case kDNSServiceErr_ServiceNotRunning: errtxt = "ServiceNotRunning"; break;
+		case kDNSServiceErr_Timeout: errtxt = "Timeout"; break;
 		default: errtxt = "?";
 	};  
 
+	// records collected before the error are not lost
+	FlushBatch();
+
 	t_atom at; 
 	SetString(at,errtxt);
 	Message(sym_error,1,&at);
 }
 
-void Base::Install(Worker *w)
+void Worker::Batch(const t_symbol *sym,int argc,const t_atom *argv,bool more,const char *hold)
 {
-    if(worker)
-        worker->shouldexit = true;
+	t_atom at;
+	SetSymbol(at,sym);
+	batched.push_back(at);
+	batched.insert(batched.end(),argv,argv+argc);
+
+	if(hold) {
+		if(!batchheld) batchheld.reset(new HandleSet);
+		batchheld->Hold(hold);
+	}
+
+	if(!more) FlushBatch();
+}
+
+void Worker::FlushBatch()
+{
+	if(!batched.empty()) {
+		Message(sym_batch,(int)batched.size(),&batched[0],batchheld);
+		batched.clear();
+		batchheld.reset();
+	}
+}
 
+void Base::Install(Worker *w)
+{
+    if(worker) Stop(worker);
     worker.reset(w);
+    if(worker) Start(worker);
+}
+
+void Base::Start(const WorkerPtr &w)
+{
+    FLEXT_ASSERT(loops);
+
+    w->owner = this;
+    w->capacity = capacity;
+    w->policy = overflow;
+    // room for all messages up to the capacity, so that bursts don't need the backlog
+    // (the worker hasn't been started yet, so the ring is still unused)
+    w->messages.Resize(capacity > ringsize?(capacity < maxringsize?capacity:maxringsize):ringsize);
+    // workers with the same shard key are served by the same thread
+    w->loop = loops[w->Shard()%nloops];
+    w->loop->Start(w);
+}
+
+void Base::Poke(Worker *w)
+{
+    w->loop->Poke(w->shared_from_this());
+}
+
+void Base::Stop(const WorkerPtr &w)
+{
+    // waiting messages of the worker will be discarded
+    w->owner = NULL;
+    w->loop->Stop(w);
+
+    dropped += w->dropped;
+    coalesced += w->coalesced;
+}
+
+////////////////////////////////////////////////
+
+bool Loop::shareconnection = false;
 
-    if(worker) {
-        FLEXT_ASSERT(newworkers);
-	    newworkers->Put(worker);
-	    // wake up worker thread....
-        cond.Signal();
+Loop::Loop()
+    : poller(new Poller)
+{}
+
+Loop::~Loop()
+{
+    delete poller;
+}
+
+void Loop::Start(const WorkerPtr &w)
+{
+    newworkers.Put(w);
+    // wake up worker thread....
+    poller->Wake();
+}
+
+void Loop::Stop(const WorkerPtr &w)
+{
+    w->shouldexit = true;
+    oldworkers.Put(w);
+    poller->Wake();
+}
+
+void Loop::Flush(const WorkerPtr &w)
+{
+    flushworkers.Put(w);
+    poller->Wake();
+}
+
+void Loop::Poke(const WorkerPtr &w)
+{
+    pokeworkers.Put(w);
+    poller->Wake();
+}
+
+void Loop::Retire(Worker *w)
+{
+    int slot = w->slot;
+    if(slot < 0) return; // not (or no longer) registered
+
+    if(w->fd >= 0) poller->Remove(w);
+    w->slot = -1;
+    // not in Close, which is also called by the destructor
+    w->FlushBatch();
+    w->Close();
+
+    // move last worker into the vacant slot, this may destroy w
+    if(slot != (int)workers.size()-1) {
+        workers[slot] = workers.back();
+        workers[slot]->slot = slot;
+    }
+    workers.pop_back();
+}
+
+void Loop::Fail(Worker *w,DNSServiceErrorType err)
+{
+    w->OnError(err);
+    w->shouldexit = true;
+    // the target (or the loop, see Done) gets hold of w, so it survives Retire
+    w->Done();
+    Retire(w);
+}
+
+int Loop::Expire()
+{
+    while(!deadlines.empty()) {
+        Deadlines::iterator it = deadlines.begin();
+        double wait = it->first-GetOSTime();
+        if(wait > 0)
+            // round up, so that we don't wake up too early
+            return (int)(wait*1000)+1;
+
+        double t = it->first;
+        WorkerPtr w(it->second.lock());
+        deadlines.erase(it);
+        if(w && w->expires == t && w->slot >= 0 && !w->shouldexit) {
+            w->expires = 0;
+            w->OnExpire();
+        }
+    }
+    return -1;
+}
+
+void Loop::Connect()
+{
+    WorkerPtr c(new Connection);
+    if(c->Init() && poller->Add(c.get()))
+        connection = c;
+    // else workers get their own connections
+}
+
+void Loop::Disconnect()
+{
+    // the subordinate operations died with the connection
+    for(int i = (int)workers.size()-1; i >= 0; --i) {
+        Worker *w = workers[i].get();
+        if(w->conn && !w->ownconn) {
+            w->client = NULL;
+            Fail(w,kDNSServiceErr_ServiceNotRunning);
+        }
+    }
+
+    poller->Remove(connection.get());
+    connection.reset();
+}
+
+Symbol Worker::Intern(const char *raw,bool unescape)
+{
+    return loop->symbols.Get(raw,unescape);
+}
+
+SymbolCache &Worker::Symbols()
+{
+    return loop->symbols;
+}
+
+void Worker::Attach(const WorkerPtr &w,bool forward)
+{
+    w->loop = loop;
+    if(forward) w->target = this;
+    loop->Start(w);
+}
+
+void Worker::Detach(const WorkerPtr &w)
+{
+    // we might be gone before the helper is retired
+    w->target = NULL;
+    w->loop->Stop(w);
+}
+
+void Worker::Expire(double secs)
+{
+    if(secs > 0) {
+        expires = GetOSTime()+secs;
+        loop->deadlines.insert(std::make_pair(expires,boost::weak_ptr<Worker>(shared_from_this())));
     }
+    else
+        expires = 0;
 }
 
-void Base::threadfun(thr_params *)
+void Worker::Done()
 {
-	FLEXT_ASSERT(newworkers);
+    if(done) return;
+    done = true;
 
-    typedef std::set<WorkerPtr> WorkerSet;
-    WorkerSet curworkers;
+    if(target)
+        target->OnDone(this);
+    else
+        // the object's reference keeps the waiting messages alive
+        loop->Stop(shared_from_this());
+}
+
+void Loop::threadfun(thr_params *p)
+{
+    Base::loops[p->var[0]._int]->Run();
+}
+
+void Loop::Run()
+{
+    const int maxready = 64;
+    Worker *ready[maxready];
 
     for(;;) {
+        // (re)establish shared connection
+        if(UNLIKELY(shareconnection && !connection && newworkers.Avail()))
+            Connect();
+
         // add new workers
-        while(UNLIKELY(newworkers->Avail())) {
+        while(UNLIKELY(newworkers.Avail())) {
             // we ought to be the only reader!
-            WorkerPtr w(newworkers->Get());
-            if(LIKELY(w->Init()))
-                curworkers.insert(w);
-            // else abandon worker
+            WorkerPtr w(newworkers.Get());
+            if(LIKELY(w->Init()) && LIKELY(w->fd < 0 || poller->Add(w.get()))) {
+                w->slot = (int)workers.size();
+                workers.push_back(w);
+            }
+            else
+                // abandon worker, errors have been reported by Init
+                w->Done();
         }
 
-	    fd_set readfds;
-	    int maxfds = -1;
-	    FD_ZERO(&readfds);
-        
-        for(WorkerSet::iterator it = curworkers.begin(); it != curworkers.end(); ) {
-		    WorkerPtr w(*it);
-            WorkerSet::iterator it1 = it; ++it1;
-
-            if(UNLIKELY(w->shouldexit))
-                curworkers.erase(it);
-            else {
-                FLEXT_ASSERT(w->client && w->fd >= 0);
-
-                FD_SET(w->fd,&readfds);
-			    if(w->fd > maxfds) maxfds = w->fd;
+        // remove retired workers
+        while(UNLIKELY(oldworkers.Avail())) {
+            WorkerPtr w(oldworkers.Get());
+            Retire(w.get());
+        }
+
+        // move backlogged messages into the freed ring slots
+        while(UNLIKELY(flushworkers.Avail())) {
+            WorkerPtr w(flushworkers.Get());
+            w->flushing = false;
+            if(!w->shouldexit) {
+                w->Flush();
+                w->Signal();
             }
+        }
+
+        // work requested by the main thread
+        while(UNLIKELY(pokeworkers.Avail())) {
+            WorkerPtr w(pokeworkers.Get());
+            if(!w->shouldexit && w->slot >= 0) w->OnPoke();
+        }
+
+        // block until the daemon has something for us, we are woken up or a deadline has passed
+        int cnt = poller->Wait(ready,maxready,Expire());
+
+        for(int i = 0; i < cnt; ++i) {
+            Worker *w = ready[i];
+            if(UNLIKELY(w->shouldexit)) continue; // is about to be retired
+
+            FLEXT_ASSERT(w->client && w->fd >= 0);
+
+            DNSServiceErrorType err = DNSServiceProcessResult(w->ownconn?w->conn:w->client);
+            if(UNLIKELY(err)) {
+                // selected and failed -> abandon worker and post error
+                post("DNSServiceProcessResult call failed: %i",err);
+
+                if(w == connection.get())
+                    Disconnect();
+                else
+                    Fail(w,err);
+            }
+        }
+    }
+}
+
+////////////////////////////////////////////////
 
-            it = it1;
-	    }
-
-        // all workers are in local myworkers now, none in curworkers
-
-	    if(maxfds >= 0) {
-		    timeval tv; 
-		    tv.tv_sec = tv.tv_usec = 0; // don't block
-		    int result = select(maxfds+1,&readfds,NULL,NULL,&tv);
-		    if(result > 0) {
-                for(WorkerSet::iterator it = curworkers.begin(); it != curworkers.end(); ++it) {
-                    WorkerPtr w(*it);
-                    FLEXT_ASSERT(w->client && w->fd >= 0);
-
-                    // let's see if worker has been selected
-				    if(/*w->fd >= 0 &&*/ FD_ISSET(w->fd,&readfds)) {
-					    DNSServiceErrorType err = DNSServiceProcessResult(w->client);
-                        if(UNLIKELY(err)) {
-                            // selected and failed -> abandon worker and post error
-						    post("DNSServiceProcessResult call failed: %i",err);
-
-                            // delete failing worker on next round
-                            w->shouldexit = true;
-                        }
-				    }
-			    }
-		    }
-	    }
-
-        cond.TimedWait(0.01);
+void Worker::Signal()
+{
+    if(!signaled.exchange(true))
+        Base::Ready(shared_from_this());
+}
+
+void Base::Ready(const WorkerPtr &w)
+{
+    readymtx.Lock();
+    readyworkers.push_back(w);
+    readymtx.Unlock();
+
+#ifndef PD_DEVEL_VERSION
+    if(!scheduled.exchange(true)) {
+        // schedule a single dispatch in the main thread
+        Lock();
+        idleclk->Delay(0);
+        Unlock();
     }
+#endif
 }
 
 #ifdef PD_DEVEL_VERSION
 t_int Base::idlefun(t_int* argv)
 {
 #else
-static flext::Timer *idleclk = NULL;
 void Base::idlefun(void *)
 {
 #endif
-    for(ObjSet::const_iterator it = objects.begin(); it != objects.end(); ++it)
-        (*it)->CbIdle();
+#ifndef PD_DEVEL_VERSION
+    scheduled = false;
+#endif
+
+    // apply the collected setting changes, once per object
+    if(UNLIKELY(!pending.empty())) {
+        std::vector<Base *> objs;
+        objs.swap(pending);
+        for(std::vector<Base *>::const_iterator it = objs.begin(); it != objs.end(); ++it)
+            if((*it)->dirty && !(*it)->transaction) (*it)->Apply();
+    }
+
+    readymtx.Lock();
+    dispatching.insert(dispatching.end(),readyworkers.begin(),readyworkers.end());
+    readyworkers.clear();
+    readymtx.Unlock();
+
+    double start = dispatchtime?GetOSTime():0;
+    int cnt = 0;
+
+    // visit the workers round-robin, one message each
+    while(!dispatching.empty()) {
+        if(dispatchmsgs && cnt >= dispatchmsgs) break;
+        if(dispatchtime && GetOSTime()-start >= dispatchtime) break;
+
+        WorkerPtr w(dispatching.front());
+        dispatching.pop_front();
+
+        if(w->owner && w->owner->Dispatch(w.get())) {
+            ++cnt;
+            // there's free space in the ring now
+            if(UNLIKELY(w->backlogged) && !w->flushing.exchange(true))
+                w->loop->Flush(w);
+        }
+
+        if(w->owner && w->messages.Avail())
+            dispatching.push_back(w);
+        else {
+            // clear first, so that new messages signal again
+            w->signaled = false;
+            if(w->owner && w->messages.Avail() && !w->signaled.exchange(true))
+                dispatching.push_back(w);
+        }
+    }
+
+    if(!dispatching.empty()) {
+        // budget exhausted, the remaining messages have to wait
+        for(std::deque<WorkerPtr>::const_iterator it = dispatching.begin(); it != dispatching.end(); ++it)
+            if((*it)->owner) (*it)->owner->deferred += (*it)->Missed();
+
+#ifndef PD_DEVEL_VERSION
+        // continue in one of the next scheduler ticks
+        scheduled = true;
+        idleclk->Delay(dispatchdelay);
+#endif
+    }
+
 #ifdef PD_DEVEL_VERSION
     return 2;
 #endif
 }
 
-bool Base::CbIdle()
+bool Base::Dispatch(Worker *w)
 {
-    if(worker) {
-        // send waiting responses
-        while(worker->messages.Avail())  // it's important that we are the only message reader...
-            ToOutAnything(GetOutAttr(),worker->messages.Get());
+    // it's important that we are the only message reader...
+    while(w->messages.Avail()) {
+        // messages discarded by the worker (see Worker::Overflow) are skipped
+        if(!w->messages.Claim()) {
+            w->messages.Pop();
+            continue;
+        }
+
+        const MessageRing::Slot &msg = w->messages.Front();
+        ToOutAnything(GetOutAttr(),msg.sym,msg.argc,msg.Atoms());
+        w->messages.Pop();
+        return true;
     }
     return false;
 }
 
-void Base::Setup(t_classid)
+static int GetSetting(const char *name,int def)
+{
+    const char *val = getenv(name);
+    return val && *val?atoi(val):def;
+}
+
+void Base::Setup(t_classid c)
 {
-	if(!newworkers) {
+	FLEXT_CADDATTR_GET(c,"deferred",deferred);
+	FLEXT_CADDATTR_VAR(c,"capacity",capacity,ms_capacity);
+	FLEXT_CADDATTR_VAR(c,"overflow",overflow,ms_overflow);
+	FLEXT_CADDATTR_GET(c,"dropped",mg_dropped);
+	FLEXT_CADDATTR_GET(c,"coalesced",mg_coalesced);
+	FLEXT_CADDMETHOD_(c,0,"begin",m_begin);
+	FLEXT_CADDMETHOD_(c,0,"commit",m_commit);
+	FLEXT_CADDMETHOD_(c,0,"lookup",m_lookup);
+
+	if(!loops) {
         Worker::sym_error = MakeSymbol("error");
 		Worker::sym_add = MakeSymbol("add");
 		Worker::sym_remove = MakeSymbol("remove");
+		Worker::sym_batch = MakeSymbol("batch");
+		sym_lookup = MakeSymbol("lookup");
+
+        // library settings
+        Loop::shareconnection = GetSetting("ZCONF_SHARECONNECTION",0) != 0;
+
+        ringsize = GetSetting("ZCONF_RING_SIZE",64);
+        if(ringsize < 2) ringsize = 2;
+        else if(ringsize > maxringsize) ringsize = maxringsize;
 
-		newworkers = new Workers;
+        dispatchmsgs = GetSetting("ZCONF_DISPATCH_MESSAGES",0);
+        dispatchtime = GetSetting("ZCONF_DISPATCH_USEC",0)*1.e-6;
+
+        nloops = GetSetting("ZCONF_THREADS",1);
+        if(nloops < 1) nloops = 1;
+        else if(nloops > 64) nloops = 64;
+
+        loops = new Loop *[nloops];
+        for(int i = 0; i < nloops; ++i)
+            loops[i] = new Loop;
 
 #ifdef PD_DEVEL_VERSION
 		sys_callback(idlefun,NULL,0);
 #else
         idleclk = new flext::Timer;
         idleclk->SetCallback(idlefun);
-        idleclk->Periodic(0.001);
 #endif
 
-        // start file helper thread
-        LaunchThread(threadfun,NULL);
+        // start helper threads
+        for(int i = 0; i < nloops; ++i) {
+            thr_params *p = new thr_params;
+            p->var[0]._int = i;
+            LaunchThread(Loop::threadfun,p);
+        }
 	}
 }
 
@@ -376,8 +1480,10 @@ static void main()
 	FLEXT_SETUP(Domains);
 	FLEXT_SETUP(Browse);
 	FLEXT_SETUP(Service);
+	FLEXT_SETUP(Services);
 	FLEXT_SETUP(Resolve);
 	FLEXT_SETUP(Meta);
+	FLEXT_SETUP(Inventory);
 }
 
 } // namespace
@@ -20,7 +20,8 @@ $LastChangedBy$
 
 #if FLEXT_OS == FLEXT_OS_WIN
 	#include <stdlib.h>
-    #include <winsock.h>
+    #include <winsock2.h>
+    #include <ws2tcpip.h>
 #else
 	#include <unistd.h>
 	#include <netdb.h>
@@ -34,7 +35,11 @@ $LastChangedBy$
 #include <vector>
 #include <string>
 #include <set>
+#include <map>
+#include <deque>
 #include <boost/shared_ptr.hpp>
+#include <boost/enable_shared_from_this.hpp>
+#include <boost/weak_ptr.hpp>
 
 
 namespace zconf {
@@ -44,47 +49,422 @@ namespace zconf {
 
 typedef const t_symbol *Symbol;
 
-std::string DNSEscape(const char *txt,bool escdot = true);
-std::string DNSUnescape(const char *txt);
+// DNS unescaping into buf of size len (output is truncated if it doesn't fit)
+// the input itself is returned if there's nothing to unescape
+const char *DNSUnescape(const char *txt,char *buf,size_t len);
+
+// text record entries, key -> value
+typedef std::map<Symbol,std::string> TxtRecords;
+
+// set the entry for key to the value given by argv (remove it if argc is 0)
+// returns true if the record has changed
+bool SetTxtRecord(TxtRecords &rec,Symbol key,int argc,const t_atom *argv);
+
+// make the DNS text record from the entries
+// entries longer than 255 bytes, or beyond the record limit of 65535 bytes, are left out
+std::string MakeTxtRecord(const TxtRecords &rec);
+
+// atomic operations on longs, loads have acquire, modifications full barrier semantics
+#if FLEXT_OS == FLEXT_OS_WIN
+inline long AtomicLoad(volatile long *p) { return InterlockedCompareExchange((LONG volatile *)p,0,0); }
+inline long AtomicExchange(volatile long *p,long v) { return InterlockedExchange((LONG volatile *)p,v); }
+inline long AtomicAdd(volatile long *p,long d) { return InterlockedExchangeAdd((LONG volatile *)p,d); }
+#else
+inline long AtomicLoad(volatile long *p) { long v = *p; __sync_synchronize(); return v; }
+inline long AtomicExchange(volatile long *p,long v) { __sync_synchronize(); return __sync_lock_test_and_set(p,v); }
+inline long AtomicAdd(volatile long *p,long d) { return __sync_fetch_and_add(p,d); }
+#endif
+
+//! Atomic integer or bool
+/*! Stands in for std::atomic, which is not available with the supported compilers.
+	Unsigned values wrap around like the underlying type.
+*/
+template<typename T>
+class Atomic
+{
+public:
+	Atomic(T v = T()): val((long)v) {}
+
+	T load() const { return (T)AtomicLoad(&val); }
+	void store(T v) { AtomicExchange(&val,(long)v); }
+	T exchange(T v) { return (T)AtomicExchange(&val,(long)v); }
+
+	operator T() const { return load(); }
+	Atomic &operator =(T v) { store(v); return *this; }
+
+	T operator ++() { return (T)(AtomicAdd(&val,1)+1); }
+	T operator --() { return (T)(AtomicAdd(&val,-1)-1); }
+	T operator +=(T d) { return (T)(AtomicAdd(&val,(long)d)+(long)d); }
+
+private:
+	mutable volatile long val;
+
+	Atomic(const Atomic &);
+	Atomic &operator =(const Atomic &);
+};
+
+class Loop;
+class Poller;
+
+class HandleSet;
+typedef boost::shared_ptr<HandleSet> HandleSetPtr;
+
+//! Lock-free single producer/single consumer ring of messages
+/*! Slots are preallocated and store short messages inline,
+	longer messages use a per-slot buffer which is kept for reuse.
+*/
+class MessageRing
+	: public flext
+{
+public:
+	enum { inlineatoms = 8 };
+
+	struct Slot {
+		const t_symbol *sym;
+		int argc;
+		t_atom atoms[inlineatoms];
+		t_atom *ext;
+		int extsize;
+		// taken by the consumer or discarded by the producer, whoever comes first
+		Atomic<bool> dead;
+		// handles used by the message, released when it is popped
+		HandleSetPtr held;
+
+		const t_atom *Atoms() const { return argc <= inlineatoms?atoms:ext; }
+	};
+
+	MessageRing(int size);
+	~MessageRing();
+
+	// number of slots
+	int Size() const { return (int)mask+1; }
+	// to be called before the ring is used, size is rounded up to a power of two
+	void Resize(int size);
+
+	// to be called by the producer, returns false if the ring is full
+	bool Put(const t_symbol *sym,int argc,const t_atom *argv,const HandleSetPtr &held = HandleSetPtr());
+
+	// to be called by the consumer
+	bool Avail() const { return head.load() != tail.load(); }
+	const Slot &Front() const { return slots[head.load()&mask]; }
+	// takes the front message, returns false if the producer has discarded it
+	// (the slot has to be popped in any case)
+	bool Claim() { if(slots[head.load()&mask].dead.exchange(true)) { --killed; return false; } else return true; }
+	void Pop() { slots[head.load()&mask].held.reset(); head.store(head.load()+1); }
+
+	// to be called by the producer, for looking at the waiting messages from Begin() up to End()
+	unsigned int Begin() const { return head.load(); }
+	unsigned int End() const { return tail.load(); }
+	const Slot &operator [](unsigned int ix) const { return slots[ix&mask]; }
+	// discards a waiting message, returns false if it has been taken or discarded before
+	bool Kill(unsigned int ix) { if(slots[ix&mask].dead.exchange(true)) return false; ++killed; return true; }
+
+	// number of waiting messages which haven't been discarded
+	int Count() const { return (int)(tail.load()-head.load())-killed; }
+
+private:
+	Slot *slots;
+	unsigned int mask;
+	Atomic<unsigned int> head,tail;
+	Atomic<int> killed; // discarded messages which haven't been popped
+};
+
+//! Direct-mapped cache of interned daemon strings
+/*! Maps raw (escaped) strings to their (unescaped) symbols, so that repeated names
+	skip both unescaping and the symbol table lookup.
+	Not thread-safe, each worker thread has its own.
+*/
+class SymbolCache
+	: public flext
+{
+public:
+	SymbolCache();
+
+	Symbol Get(const char *raw,bool unescape = true);
+
+private:
+	enum { size = 256,maxlen = 64 };
+
+	struct Entry {
+		Symbol sym;
+		bool unescape;
+		char raw[maxlen];
+	};
+
+	Entry entries[size];
+};
+
+//! Refcounted table of strings referred to by small integer handles
+/*! Used instead of symbols for short-lived strings, as Pd symbols are never freed.
+	The same string has the same handle while it's referenced, freed handles are reused last.
+	Thread-safe.
+*/
+class StringTable
+	: public flext
+{
+public:
+	// adds a reference to s, returns its handle (> 0)
+	int Acquire(const char *s);
+	// handle of s (or 0 if not referenced), no reference is added
+	int Find(const char *s) const;
+	void Release(int h);
+	// returns false if h is not referenced
+	bool Lookup(int h,std::string &s) const;
+
+private:
+	mutable ThrMutex mtx;
+	std::vector<std::string> strs; // string of handle h at h-1
+	std::vector<int> refs;
+	std::map<std::string,int> index;
+	std::deque<int> freed;
+};
+
+extern StringTable stringtable;
+
+//! References to string table handles, released together with the set
+/*! Owned by whoever keeps the output valid (a request, a browsed instance), 
+	shared with the worker filling it. Not thread-safe, only one thread may add to it.
+*/
+class HandleSet
+	: public flext
+{
+public:
+	~HandleSet();
+
+	// handle for s, referenced once by the set
+	int Hold(const char *s);
+
+private:
+	std::set<int> held;
+};
+
+class Base;
+
+enum {
+	overflow_dropnewest = 0,
+	overflow_dropoldest = 1,
+	overflow_coalesce = 2	// add/remove pairs for the same service, else drop oldest
+};
 
 class Worker
 	: public flext
+	, public boost::enable_shared_from_this<Worker>
 {
 	friend class Base;
+	friend class Loop;
+	friend class Poller;
 
 public:
 	virtual ~Worker();
 
 protected:
-	Worker(): client(0),fd(-1),shouldexit(false) {}
+	Worker(): client(0),conn(0),ownconn(false),fd(-1),shouldexit(false),done(false),expires(0),owner(NULL),signaled(false),backlogged(0),flushing(false),produced(0),counted(0),capacity(0),policy(0),dropped(0),coalesced(0),scan(0),loop(NULL),slot(-1),pollix(-1),target(NULL),tag(NULL),messages(64) {}
 	
-    void Message(AtomAnything &msg) { messages.Put(msg); }
-    void Message(const t_symbol *sym,int argc,const t_atom *argv) { AtomAnything msg(sym,argc,argv); Message(msg); }
+    // to be called from worker thread
+    // the references of held are kept until the message has been output (or discarded)
+    void Message(const t_symbol *sym,int argc,const t_atom *argv,const HandleSetPtr &held = HandleSetPtr());
+
+    virtual void OnError(DNSServiceErrorType error);
+
+	// collect a record into one batch message, which is sent when no more records are coming
+	// with hold given, its handle is kept valid until the batch has been output
+	void Batch(const t_symbol *sym,int argc,const t_atom *argv,bool more,const char *hold = NULL);
+	// send the records collected so far (if any)
+	void FlushBatch();
 
-    void OnError(DNSServiceErrorType error);
+	// key for distributing workers among the worker threads
+	virtual unsigned int Shard() const;
+	static unsigned int Hash(Symbol a,Symbol b = NULL);
 
 	// to be called from worker thread (does the actual work)
 	virtual bool Init();	
+
+	// to be called from worker thread, releases the daemon operation
+	virtual void Close();
+
+	// to be called from worker thread before creating the operation into client
+	// returns the flags needed to make it a subordinate of the shared connection (if enabled)
+	// with subordinate set, a private connection is made otherwise, so that further
+	// operations can be created as subordinates of conn (returns 0 if that fails)
+	DNSServiceFlags Share(bool subordinate = false);
+
+	// to be called from worker thread, symbol for a (DNS-escaped) daemon string
+	Symbol Intern(const char *raw,bool unescape = true);
+	SymbolCache &Symbols();
+
+	// to be called from worker thread, runs or stops a helper worker on our thread
+	// with forward set, the messages of the helper are passed on to us
+	void Attach(const boost::shared_ptr<Worker> &w,bool forward = false);
+	void Detach(const boost::shared_ptr<Worker> &w);
+
+	// to be called from worker thread when the job is finished (also called by the worker thread on failure)
+	// a forwarding helper notifies its target, other workers release themselves (only once)
+	void Done();
+
+	// called from worker thread when the forwarding helper w has finished its job
+	virtual void OnDone(Worker *w) {}
+
+	// called from worker thread with a message of the forwarding helper w
+	// passes it on by default, may be overridden to consume it instead
+	virtual void OnForward(Worker *w,const t_symbol *sym,int argc,const t_atom *argv) { Message(sym,argc,argv); }
+
+	// worker thread serving this worker
+	Loop *Thread() const { return loop; }
+
+	// called from worker thread on request of the main thread (see Base::Poke)
+	virtual void OnPoke() {}
+
+	// to be called from worker thread, OnExpire is called after secs (replacing a former deadline, 0 cancels it)
+	void Expire(double secs);
+	virtual void OnExpire() {}
 	
 	DNSServiceRef client;
+	DNSServiceRef conn; // connection the operation belongs to (or NULL if client has its own)
+	bool ownconn; // conn is private to this worker
 	int fd;
     bool shouldexit;
+    bool done; // worker thread only
+    double expires; // deadline set by Expire (or 0), worker thread only
+
+private:
+    Base *owner; // object receiving the messages (only touched by the main thread)
+    Atomic<bool> signaled; // worker is in the list of workers with waiting messages
+
+    // to be called from worker thread, schedules the dispatching of waiting messages
+    void Signal();
+
+    // messages which didn't fit into the ring (only touched by the worker thread)
+    struct Backlogged
+        : AtomAnything
+    {
+        Backlogged(const t_symbol *sym,int argc,const t_atom *argv,const HandleSetPtr &h): AtomAnything(sym,argc,argv),held(h) {}
+        HandleSetPtr held;
+    };
+
+    std::deque<Backlogged> backlog;
+    Atomic<int> backlogged; // size of the backlog
+    Atomic<bool> flushing; // a flush of the backlog has been requested
+
+    // to be called from worker thread, moves backlog into the ring
+    // returns true if the backlog is empty
+    bool Flush();
+
+    int Waiting() const { return messages.Count()+backlogged; }
+
+    // number of messages queued so far
+    Atomic<unsigned int> produced;
+    // produced count up to which the waiting messages have been counted as deferred (only touched by the main thread)
+    unsigned int counted;
+
+    // to be called from main thread when the waiting messages miss a dispatch
+    // returns the number of those not counted before
+    int Missed();
+
+    // bound for the waiting messages (0 means unlimited) and what to do when it's reached
+    Atomic<int> capacity,policy;
+    // overflow counters
+    Atomic<int> dropped,coalesced;
+
+    // to be called from worker thread if the capacity is reached
+    // makes room for a new message, returns false if the message should be dropped
+    bool Overflow(const t_symbol *sym,int argc,const t_atom *argv);
+
+    // ring index below which all waiting messages are known to be taken or discarded (only touched by the worker thread)
+    unsigned int scan;
+
+    Loop *loop; // worker thread serving this worker
+    int slot;   // index in the worker thread's list of registered workers
+    int pollix; // index in the poller (if not epoll)
+
+    Worker *target; // worker receiving our messages (only for forwarding helpers)
+
+protected:
 
-	typedef struct { unsigned char c[ 64]; } domainlabel;      // One label: length byte and up to 63 characters.
-	typedef struct { unsigned char c[256]; } domainname;       // Up to 255 bytes of length-prefixed domainlabels.
+	// split PTR rdata of a meta query into escaped type and domain, false if malformed or too long
+	static bool conv_type_domain(const void *rdata, uint16_t rdlen, char *type, size_t typelen, char *domain, size_t domainlen);
 
-	static char *conv_label2str(const domainlabel *label, char *ptr);
-	static char *conv_domain2str(const domainname *name, char *ptr);
-	static bool conv_type_domain(const void *rdata, uint16_t rdlen, char *type, char *domain);
+	static Symbol sym_error,sym_add,sym_remove,sym_batch;
 
-	static Symbol sym_error,sym_add,sym_remove;
+	std::vector<t_atom> batched;
+	HandleSetPtr batchheld;
 
-    typedef ValueFifo<AtomAnything> Messages;
-    Messages messages;
+	// prepended to all messages (if set)
+	Symbol tag;
+	std::vector<t_atom> tagged;
+
+    MessageRing messages;
 };
 
 typedef boost::shared_ptr<Worker> WorkerPtr;
 
+// resolver for one service instance, to be attached as a helper (zconf_resolve.cpp)
+// with oneshot set it's done after the first complete answer
+// txtmode: text record values as 0 (symbols), 1 (numbers where possible), 2 (raw bytes)
+// with held given, names, addresses and text values are output as handles referenced by held
+// messages: resolve (as zconf.resolve), txtrecord name ..., lost (like resolve, for a vanished address)
+// without any address after 10 seconds, it reports a Timeout error and is done
+WorkerPtr NewResolver(const char *name,Symbol type,Symbol domain,int interf,bool oneshot,int txtmode = 0,const HandleSetPtr &held = HandleSetPtr());
+
+// browser for one service type, to be attached as a helper (zconf_browse.cpp)
+// shares the daemon operation with the other browsers of the type on the same worker thread
+WorkerPtr NewBrowser(Symbol type,Symbol domain,int interf);
+
+// query for the service types, to be attached as a helper (zconf_meta.cpp)
+WorkerPtr NewMetaQuery(int interf);
+
+
+//! An event loop thread and the workers it serves
+class Loop
+	: public flext
+{
+	friend class Worker;
+
+public:
+	Loop();
+	~Loop();
+
+	// to be called from the main thread
+	void Start(const WorkerPtr &w);
+	void Stop(const WorkerPtr &w);
+	void Flush(const WorkerPtr &w);
+	// have the worker thread call w->OnPoke()
+	void Poke(const WorkerPtr &w);
+
+	static void threadfun(thr_params *p);
+
+	// operations are subordinates of a shared daemon connection
+	static bool shareconnection;
+
+private:
+    typedef ValueFifo<WorkerPtr> Workers;
+	Workers newworkers,oldworkers,flushworkers,pokeworkers;
+
+	// registered workers, a worker's slot is its index
+	typedef std::vector<WorkerPtr> WorkerList;
+	WorkerList workers;
+
+	Poller *poller;
+
+	// shared daemon connection
+	WorkerPtr connection;
+
+	// symbols of the strings seen by this thread
+	SymbolCache symbols;
+
+	// deadlines set by Worker::Expire, entries not matching the worker's are stale
+	typedef std::multimap<double,boost::weak_ptr<Worker> > Deadlines;
+	Deadlines deadlines;
+
+	// call OnExpire for the passed deadlines, returns the time to wait for the next one (in ms, -1 for none)
+	int Expire();
+
+	void Run();
+	void Retire(Worker *w);
+	// retire a worker whose operation has failed, the error is reported and the job is done
+	void Fail(Worker *w,DNSServiceErrorType err);
+	void Connect();
+	void Disconnect();
+};
 
 class Base
 	: public flext_base
@@ -92,6 +472,7 @@ class Base
 	FLEXT_HEADER_S(Base,flext_base,Setup)
 
 	friend class Worker;
+	friend class Loop;
 
 public:
 	Base();
@@ -100,11 +481,96 @@ public:
 protected:
 	void Install(Worker *w);
 
+	// run further workers for this object besides the installed one
+	void Start(const WorkerPtr &w);
+	void Stop(const WorkerPtr &w);
+
+	// currently installed worker (or NULL)
+	Worker *Current() const { return worker.get(); }
+
+	// number of messages of w still waiting for output
+	static int Waiting(const Worker *w) { return w->Waiting(); }
+
+	// have w do its pending work (see Worker::OnPoke) in its thread
+	void Poke(Worker *w);
+
+	// (re)create the worker from the current settings
+	virtual void Update() {}
+
+	// to be called from main thread on changed settings
+	// Update is called at the next idle tick, or at commit within begin/commit
+	void Defer();
+
+	void m_begin() { ++transaction; }
+	void m_commit();
+
+	FLEXT_CALLBACK(m_begin)
+	FLEXT_CALLBACK(m_commit)
+
+	// output the strings of handles (see StringTable)
+	void m_lookup(int argc,const t_atom *argv);
+
+	FLEXT_CALLBACK_V(m_lookup)
+
+	// called in the main thread to output the next waiting message of w
+	// returns false if there was none
+	virtual bool Dispatch(Worker *w);
+
+	// number of messages that had to wait for a later dispatch, each counted once
+	int deferred;
+
+	// bound for the waiting messages per worker and overflow policy
+	int capacity,overflow;
+
+	void ms_capacity(int c);
+	void ms_overflow(int o);
+
+	// overflow counters of the retired workers
+	int dropped,coalesced;
+
+	void mg_dropped(int &d) const { d = dropped+(worker?(int)worker->dropped:0); }
+	void mg_coalesced(int &c) const { c = coalesced+(worker?(int)worker->coalesced:0); }
+
+	FLEXT_ATTRGET_I(deferred)
+	FLEXT_ATTRGET_I(capacity)
+	FLEXT_CALLSET_I(ms_capacity)
+	FLEXT_ATTRGET_I(overflow)
+	FLEXT_CALLSET_I(ms_overflow)
+	FLEXT_CALLGET_I(mg_dropped)
+	FLEXT_CALLGET_I(mg_coalesced)
+
 private:
 	WorkerPtr worker;
 
-    typedef ValueFifo<WorkerPtr> Workers;
-	static Workers *newworkers;
+	// nesting depth of begin/commit
+	int transaction;
+	// settings have changed since the last Update
+	bool dirty;
+
+	// objects with deferred updates (only touched by the main thread)
+	static std::vector<Base *> pending;
+
+	void Apply() { dirty = false; Update(); }
+
+	// workers with waiting messages
+	static ThrMutex readymtx;
+	static std::vector<WorkerPtr> readyworkers;
+	static std::deque<WorkerPtr> dispatching;
+
+	// default number of ring slots per worker (see Start)
+	static int ringsize;
+
+	// dispatch budget per scheduler tick (0 means unlimited)
+	static int dispatchmsgs;
+	static double dispatchtime;
+	static const double dispatchdelay;
+
+	// to be called from worker thread
+	static void Ready(const WorkerPtr &w);
+
+	// worker threads
+	static Loop **loops;
+	static int nloops;
 
 #ifdef PD_DEVEL_VERSION
 	static t_int idlefun(t_int *data);
@@ -112,13 +578,7 @@ private:
     static void idlefun(void *);
 #endif
 
-    static void threadfun(thr_params *);
-
 	static void Setup(t_classid);
-
-    static ThrCond cond;
-
-    virtual bool CbIdle();
 };
 
 } // namespace
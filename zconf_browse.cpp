@@ -11,26 +11,58 @@ $LastChangedBy$
 */
 
 #include "zconf.h"
+#include <map>
+#include <algorithm>
 
 namespace zconf {
 
-class BrowseWorker
+// reported by the resolvers for vanished addresses
+static Symbol sym_lost;
+
+class BrowseWorker;
+
+// one daemon browse operation for each (type,domain,interface,thread) key, fanned out to all subscribed workers
+// all subscribers share the worker thread with the subscription (see BrowseWorker::Shard)
+class BrowseSubscription
 	: public Worker
 {
 public:
-	BrowseWorker(Symbol t,Symbol d,int i)
-        : type(t),domain(d),interf(i)
-	{}
-	
+	struct Key
+	{
+		Key(Symbol t,Symbol d,int i,const Loop *l): type(t),domain(d),interf(i),loop(l) {}
+
+		Symbol type,domain;
+		int interf;
+		// helpers run on their owner's thread, subscriptions can't be shared across threads
+		const Loop *loop;
+
+		bool operator <(const Key &k) const
+		{
+			if(type != k.type) return type < k.type;
+			if(domain != k.domain) return domain < k.domain;
+			if(interf != k.interf) return interf < k.interf;
+			return loop < k.loop;
+		}
+	};
+
+	typedef boost::shared_ptr<BrowseSubscription> Ptr;
+
+	BrowseSubscription(const Key &k): key(k) {}
+
+	// to be called from worker thread
+	// returns the running subscription for the key, a new one is attached to the thread of w
+	static Ptr Subscribe(BrowseWorker *w,const Key &k);
+	void Unsubscribe(BrowseWorker *w);
+
 protected:
 	virtual bool Init()
 	{
 		DNSServiceErrorType err = DNSServiceBrowse(
             &client, 
-			0, // default renaming behaviour
-            interf < 0?kDNSServiceInterfaceIndexLocalOnly:kDNSServiceInterfaceIndexAny, 
-			GetString(type), 
-			domain?GetString(domain):NULL, 
+			Share(), // shared connection (if enabled), default renaming behaviour
+            key.interf < 0?kDNSServiceInterfaceIndexLocalOnly:kDNSServiceInterfaceIndexAny, 
+			GetString(key.type), 
+			key.domain?GetString(key.domain):NULL, 
 			&callback, this
         );
 
@@ -40,14 +72,63 @@ protected:
 		}
 		else {
 			OnError(err);
+			Unregister();
+			Lost();
 			return false;
 		}
 	} 
-	
-	Symbol type,domain;
-    int interf;
+
+	virtual void Close()
+	{
+		Unregister();
+		Lost();
+		Worker::Close();
+	}
+
+	// errors are passed on to the subscribers
+	virtual void OnError(DNSServiceErrorType error);
+
+	Key key;
 
 private:
+	std::vector<BrowseWorker *> subscribers;
+
+	// currently known instances, for the snapshot of new subscribers
+	struct Instance
+	{
+		Instance(const char *n,const char *t,const char *d,int i): name(n),type(t),domain(d),ifix(i) {}
+
+		std::string name,type,domain;
+		int ifix;
+
+		bool operator <(const Instance &i) const
+		{
+			int c = name.compare(i.name);
+			if(c) return c < 0;
+			if(ifix != i.ifix) return ifix < i.ifix;
+			c = type.compare(i.type);
+			if(c) return c < 0;
+			return domain < i.domain;
+		}
+	};
+
+	std::set<Instance> instances;
+
+	typedef std::map<Key,Ptr> Registry;
+	static Registry registry;
+	static ThrMutex registrymtx;
+
+	// subscribers left when the operation ends means that it has failed, they are done as well
+	void Lost();
+
+	void Unregister()
+	{
+		registrymtx.Lock();
+		Registry::iterator it = registry.find(key);
+		if(it != registry.end() && it->second.get() == this) registry.erase(it);
+		registrymtx.Unlock();
+	}
+
     static void DNSSD_API callback(
         DNSServiceRef client, 
         DNSServiceFlags flags, // kDNSServiceFlagsMoreComing + kDNSServiceFlagsAdd
@@ -58,26 +139,336 @@ private:
         const char *replyDomain,                             
         void *context)
     {
-        BrowseWorker *w = (BrowseWorker *)context;
+        BrowseSubscription *s = (BrowseSubscription *)context;
 		if(LIKELY(errorCode == kDNSServiceErr_NoError))
-			w->OnBrowse(replyName,replyType,replyDomain,ifIndex,(flags & kDNSServiceFlagsAdd) != 0,(flags & kDNSServiceFlagsMoreComing) != 0);
+			s->OnBrowse(replyName,replyType,replyDomain,ifIndex,(flags & kDNSServiceFlagsAdd) != 0,(flags & kDNSServiceFlagsMoreComing) != 0);
 		else
-			w->OnError(errorCode);
+			s->OnError(errorCode);
     }
 
 	// can be called from a secondary thread
-    void OnBrowse(const char *name,const char *type,const char *domain,int ifix,bool add,bool more)
+    void OnBrowse(const char *name,const char *type,const char *domain,int ifix,bool add,bool more);
+};
+
+BrowseSubscription::Registry BrowseSubscription::registry;
+flext::ThrMutex BrowseSubscription::registrymtx;
+
+
+class BrowseWorker
+	: public Worker
+{
+	friend class BrowseSubscription;
+
+public:
+	// with r set, instances are resolved, at most m at a time
+	// with h set, service names are output as handles (see StringTable)
+	BrowseWorker(Symbol t,Symbol d,int i,bool b,bool r,int m,bool h)
+        : type(t),domain(d),interf(i),batch(b)
+        , resolve(r),maxresolve(m),handles(h)
+	{}
+	
+protected:
+	virtual unsigned int Shard() const { return Hash(type,domain); }
+
+	virtual bool Init()
+	{
+		// passive, events are delivered by the subscription
+		subscription = BrowseSubscription::Subscribe(this,BrowseSubscription::Key(type,domain,interf,Thread()));
+		fd = -1;
+		return true;
+	} 
+
+	virtual void Close()
+	{
+		if(subscription) {
+			subscription->Unsubscribe(this);
+			subscription.reset();
+		}
+
+		// references of the live instances
+		if(handles) {
+			for(Table::const_iterator it = table.begin(); it != table.end(); ++it) {
+				int h = stringtable.Find(it->first.c_str());
+				for(size_t i = 0; i < it->second.size(); ++i) stringtable.Release(h);
+			}
+		}
+
+		pending.clear();
+		for(Resolving::const_iterator it = resolving.begin(); it != resolving.end(); ++it)
+			Detach(it->second);
+		resolving.clear();
+		resolved.clear();
+
+		Worker::Close();
+	}
+
+	// the resolvers are oneshot, so an address vanishing meanwhile is of no interest
+	virtual void OnForward(Worker *w,const t_symbol *sym,int argc,const t_atom *argv)
+	{
+		if(sym != sym_lost) Message(sym,argc,argv);
+	}
+
+	// a resolver has delivered its answer
+	virtual void OnDone(Worker *w)
+	{
+		for(Resolving::iterator it = resolving.begin(); it != resolving.end(); ++it)
+			if(it->second.get() == w) {
+				Detach(it->second);
+				resolving.erase(it);
+				break;
+			}
+		Pump();
+	}
+	
+	Symbol type,domain;
+    int interf;
+    bool batch;
+    bool resolve;
+    int maxresolve;
+    bool handles;
+
+	// resolve pipeline (only touched by the worker thread)
+	// keyed by the service name as a string, so that it isn't made a symbol in handles mode
+	struct Job
+	{
+		Job(const std::string &n,Symbol t,Symbol d): name(n),type(t),domain(d) {}
+		std::string name;
+		Symbol type,domain;
+	};
+
+	typedef std::map<std::string,WorkerPtr> Resolving;
+
+	std::deque<Job> pending;
+	Resolving resolving;
+
+	// references of the handles in the resolver output, kept while the instance lives
+	std::map<std::string,HandleSetPtr> resolved;
+
+	void Cancel(const std::string &name)
+	{
+		resolved.erase(name);
+
+		for(std::deque<Job>::iterator it = pending.begin(); it != pending.end(); ++it)
+			if(it->name == name) {
+				pending.erase(it);
+				return;
+			}
+
+		Resolving::iterator it = resolving.find(name);
+		if(it != resolving.end()) {
+			Detach(it->second);
+			resolving.erase(it);
+			Pump();
+		}
+	}
+
+	// start waiting resolves up to the concurrency limit
+	void Pump()
+	{
+		while(!pending.empty() && (maxresolve <= 0 || (int)resolving.size() < maxresolve)) {
+			Job job = pending.front();
+			pending.pop_front();
+
+			HandleSetPtr h;
+			if(handles) {
+				h.reset(new HandleSet);
+				resolved[job.name] = h;
+			}
+
+			WorkerPtr r = NewResolver(job.name.c_str(),job.type,job.domain,interf,true,0,h);
+			resolving[job.name] = r;
+			Attach(r,true);
+		}
+	}
+
+	BrowseSubscription::Ptr subscription;
+
+	// the subscription has failed
+	void OnLost()
+	{
+		subscription.reset();
+		Done();
+	}
+
+public:
+	// live instances, service name -> interface indices
+	typedef std::map<std::string,std::set<int> > Table;
+
+	// to be called from main thread
+	int Count() const
+	{
+		tablemtx.Lock();
+		int cnt = (int)table.size();
+		tablemtx.Unlock();
+		return cnt;
+	}
+
+	bool Has(const std::string &name) const
+	{
+		tablemtx.Lock();
+		bool has = table.find(name) != table.end();
+		tablemtx.Unlock();
+		return has;
+	}
+
+	void Get(Table &t) const
+	{
+		tablemtx.Lock();
+		t = table;
+		tablemtx.Unlock();
+	}
+
+private:
+	Table table;
+	mutable ThrMutex tablemtx;
+
+	// can be called from a secondary thread
+	// raw is the service name as received from the daemon, it's only made a symbol for output as such
+    void OnBrowse(const char *raw,Symbol type,Symbol domain,int ifix,bool add,bool more)
     {
-        t_atom at[5]; 
-		SetString(at[0],DNSUnescape(name).c_str());
-		SetString(at[1],type);
-		SetString(at[2],DNSUnescape(domain).c_str());
-		SetInt(at[3],ifix);
-		SetBool(at[4],more);
-		Message(add?sym_add:sym_remove,5,at);
+		char buf[kDNSServiceMaxDomainName];
+		Symbol sym = handles?NULL:Intern(raw);
+		std::string name(sym?GetString(sym):DNSUnescape(raw,buf,sizeof buf));
+
+		bool appeared = false,vanished = false,changed = false;
+		tablemtx.Lock();
+		if(add) {
+			std::set<int> &ifs = table[name];
+			appeared = ifs.empty();
+			changed = ifs.insert(ifix).second;
+		}
+		else {
+			Table::iterator it = table.find(name);
+			if(it != table.end()) {
+				changed = it->second.erase(ifix) != 0;
+				if(it->second.empty()) {
+					table.erase(it);
+					vanished = true;
+				}
+			}
+		}
+		tablemtx.Unlock();
+
+		// each instance is resolved once, when it first appears on any interface
+		if(resolve) {
+			if(appeared) {
+				pending.push_back(Job(name,type,domain));
+				Pump();
+			}
+			else if(vanished)
+				Cancel(name);
+		}
+
+		t_atom msg[5];
+		SetSymbol(msg[1],type);
+		SetSymbol(msg[2],domain);
+		SetInt(msg[3],ifix);
+
+		// the reference of a removed (instance,interface) is passed on to the remove message
+		bool hold = false;
+		int h = 0;
+		if(handles) {
+			// each (instance,interface) holds a reference to the name
+			if(add)
+				h = changed?stringtable.Acquire(name.c_str()):stringtable.Find(name.c_str());
+			else
+				h = stringtable.Find(name.c_str()),hold = changed;
+			SetInt(msg[0],h);
+		}
+		else
+			SetSymbol(msg[0],sym);
+
+		if(batch)
+			Batch(add?sym_add:sym_remove,4,msg,more,hold?name.c_str():NULL);
+		else {
+			HandleSetPtr held;
+			if(hold) {
+				held.reset(new HandleSet);
+				held->Hold(name.c_str());
+			}
+			SetBool(msg[4],more);
+			Message(add?sym_add:sym_remove,5,msg,held);
+		}
+
+		if(hold) stringtable.Release(h);
     }
 };
 
+BrowseSubscription::Ptr BrowseSubscription::Subscribe(BrowseWorker *w,const Key &k)
+{
+	Ptr s;
+	bool created = false;
+
+	registrymtx.Lock();
+	Registry::iterator it = registry.find(k);
+	// a subscription about to be retired can't be joined
+	if(it != registry.end() && !it->second->shouldexit)
+		s = it->second;
+	else {
+		s.reset(new BrowseSubscription(k));
+		registry[k] = s;
+		created = true;
+	}
+	registrymtx.Unlock();
+
+	if(created)
+		w->Attach(s);
+	else if(!s->instances.empty()) {
+		// snapshot of the known instances
+		std::set<Instance>::const_iterator last = --s->instances.end();
+		for(std::set<Instance>::const_iterator it = s->instances.begin(); it != s->instances.end(); ++it)
+			w->OnBrowse(it->name.c_str(),w->Intern(it->type.c_str(),false),w->Intern(it->domain.c_str()),it->ifix,true,it != last);
+	}
+
+	s->subscribers.push_back(w);
+	return s;
+}
+
+void BrowseSubscription::Unsubscribe(BrowseWorker *w)
+{
+	std::vector<BrowseWorker *>::iterator it = std::find(subscribers.begin(),subscribers.end(),w);
+	if(it == subscribers.end()) return;
+	subscribers.erase(it);
+
+	if(subscribers.empty()) {
+		Unregister();
+		w->Detach(shared_from_this());
+	}
+}
+
+void BrowseSubscription::Lost()
+{
+	std::vector<BrowseWorker *> subs;
+	subs.swap(subscribers);
+	for(std::vector<BrowseWorker *>::const_iterator it = subs.begin(); it != subs.end(); ++it)
+		(*it)->OnLost();
+}
+
+void BrowseSubscription::OnError(DNSServiceErrorType error)
+{
+	for(std::vector<BrowseWorker *>::const_iterator it = subscribers.begin(); it != subscribers.end(); ++it)
+		(*it)->OnError(error);
+}
+
+void BrowseSubscription::OnBrowse(const char *name,const char *type,const char *domain,int ifix,bool add,bool more)
+{
+	Instance inst(name,type,domain,ifix);
+	if(add)
+		instances.insert(inst);
+	else
+		instances.erase(inst);
+
+	// the name is interned by the subscribers which output symbols
+	Symbol t = Intern(type,false),d = Intern(domain);
+	for(std::vector<BrowseWorker *>::const_iterator it = subscribers.begin(); it != subscribers.end(); ++it)
+		(*it)->OnBrowse(name,t,d,ifix,add,more);
+}
+
+WorkerPtr NewBrowser(Symbol type,Symbol domain,int interf)
+{
+    return WorkerPtr(new BrowseWorker(type,domain,interf,false,false,0,false));
+}
+
 class Browse
 	: public Base
 {
@@ -85,7 +476,8 @@ class Browse
 public:
 
 	Browse(int argc,const t_atom *argv)
-		: type(NULL),domain(NULL),interf(0)
+		: type(NULL),domain(NULL),interf(0),batch(false)
+		, resolve(false),maxresolve(4),handles(false)
 	{
 		if(argc >= 1) {
 			if(IsSymbol(*argv)) 
@@ -108,7 +500,7 @@ public:
 				throw "interface must be an int";
 			--argc,++argv;
 		}
-		Update();
+		Defer();
 	}
 
 	void ms_type(const AtomList &args)
@@ -125,7 +517,7 @@ public:
 
 		if(t != type) {
 			type = t;
-			Update();
+			Defer();
 		}
 	}
 
@@ -145,7 +537,7 @@ public:
 
 		if(d != domain) {
 			domain = d;
-			Update();
+			Defer();
 		}
 	}
 	
@@ -155,32 +547,134 @@ public:
 	{
 		if(i != interf) {
 			interf = i;
-			Update();
+			Defer();
+		}
+	}
+
+	void ms_batch(bool b)
+	{
+		if(b != batch) {
+			batch = b;
+			Defer();
+		}
+	}
+
+	void ms_resolve(bool r)
+	{
+		if(r != resolve) {
+			resolve = r;
+			Defer();
+		}
+	}
+
+	void ms_maxresolve(int m)
+	{
+		if(m != maxresolve) {
+			maxresolve = m;
+			if(resolve) Defer();
+		}
+	}
+
+	void ms_handles(bool h)
+	{
+		if(h != handles) {
+			handles = h;
+			Defer();
 		}
 	}
 
+	void m_count()
+	{
+		BrowseWorker *w = (BrowseWorker *)Current();
+		t_atom at;
+		SetInt(at,w?w->Count():0);
+		ToOutAnything(GetOutAttr(),sym_count,1,&at);
+	}
+
+	void m_has(const t_symbol *name)
+	{
+		BrowseWorker *w = (BrowseWorker *)Current();
+		t_atom at[2];
+		SetSymbol(at[0],name);
+		SetBool(at[1],w && w->Has(GetString(name)));
+		ToOutAnything(GetOutAttr(),sym_has,2,at);
+	}
+
+	// one message per instance with its interfaces, terminated by an empty one
+	void m_dump()
+	{
+		BrowseWorker *w = (BrowseWorker *)Current();
+		if(w) {
+			BrowseWorker::Table t;
+			w->Get(t);
+
+			std::vector<t_atom> at;
+			for(BrowseWorker::Table::const_iterator it = t.begin(); it != t.end(); ++it) {
+				at.resize(1+it->second.size());
+				SetString(at[0],it->first.c_str());
+				int i = 1;
+				for(std::set<int>::const_iterator ifit = it->second.begin(); ifit != it->second.end(); ++ifit)
+					SetInt(at[i++],*ifit);
+				ToOutAnything(GetOutAttr(),sym_dump,(int)at.size(),&at[0]);
+			}
+		}
+		ToOutAnything(GetOutAttr(),sym_dump,0,NULL);
+	}
+
 protected:
 	Symbol type,domain;
     int interf;
+    bool batch;
+    bool resolve;
+    int maxresolve;
+    bool handles;
 	
 	virtual void Update()
 	{
-        Install(type?new BrowseWorker(type,domain,interf):NULL);
+        Install(type?new BrowseWorker(type,domain,interf,batch,resolve,maxresolve,handles):NULL);
 	}
 
 	FLEXT_CALLVAR_V(mg_type,ms_type)
 	FLEXT_CALLVAR_V(mg_domain,ms_domain)
 	FLEXT_CALLSET_I(ms_interface)
 	FLEXT_ATTRGET_I(interf)
+	FLEXT_CALLSET_B(ms_batch)
+	FLEXT_ATTRGET_B(batch)
+	FLEXT_CALLSET_B(ms_resolve)
+	FLEXT_ATTRGET_B(resolve)
+	FLEXT_CALLSET_I(ms_maxresolve)
+	FLEXT_ATTRGET_I(maxresolve)
+	FLEXT_CALLSET_B(ms_handles)
+	FLEXT_ATTRGET_B(handles)
+	FLEXT_CALLBACK(m_count)
+	FLEXT_CALLBACK_S(m_has)
+	FLEXT_CALLBACK(m_dump)
+
+	static Symbol sym_count,sym_has,sym_dump;
 	
 	static void Setup(t_classid c)
 	{
+		sym_count = MakeSymbol("count");
+		sym_has = MakeSymbol("has");
+		sym_dump = MakeSymbol("dump");
+		sym_lost = MakeSymbol("lost");
+
+		FLEXT_CADDMETHOD_(c,0,sym_count,m_count);
+		FLEXT_CADDMETHOD_(c,0,sym_has,m_has);
+		FLEXT_CADDMETHOD_(c,0,sym_dump,m_dump);
+
 		FLEXT_CADDATTR_VAR(c,"type",mg_type,ms_type);
 		FLEXT_CADDATTR_VAR(c,"domain",mg_domain,ms_domain);
 		FLEXT_CADDATTR_VAR(c,"interface",interf,ms_interface);
+		FLEXT_CADDATTR_VAR(c,"batch",batch,ms_batch);
+		FLEXT_CADDATTR_VAR(c,"resolve",resolve,ms_resolve);
+		FLEXT_CADDATTR_VAR(c,"maxresolve",maxresolve,ms_maxresolve);
+		FLEXT_CADDATTR_VAR(c,"handles",handles,ms_handles);
 	}
 };
 
+Symbol Browse::sym_count,Browse::sym_has,Browse::sym_dump;
+
 FLEXT_LIB_V("zconf.browse, zconf",Browse)
 
 } //namespace
@@ -18,19 +18,19 @@ class DomainsWorker
 	: public Worker
 {
 public:
-	DomainsWorker(int i,bool reg)
-        : interf(i),regdomains(reg)
+	DomainsWorker(int i,bool reg,bool b)
+        : interf(i),regdomains(reg),batch(b)
 	{}
 	
 protected:
 	int interf;
-    bool regdomains;
+    bool regdomains,batch;
 
 	virtual bool Init()
 	{
         DNSServiceErrorType err = DNSServiceEnumerateDomains( 
             &client, 
-            regdomains?kDNSServiceFlagsRegistrationDomains:kDNSServiceFlagsBrowseDomains, // flags
+            Share()|(regdomains?kDNSServiceFlagsRegistrationDomains:kDNSServiceFlagsBrowseDomains), // flags
             interf < 0?kDNSServiceInterfaceIndexLocalOnly:kDNSServiceInterfaceIndexAny, 
             &callback, this
         );
@@ -66,10 +66,14 @@ private:
     void OnDomain(const char *domain,int ifix,bool add,bool more)
     {
         t_atom at[3]; 
-		SetString(at[0],DNSUnescape(domain).c_str());
+		SetSymbol(at[0],Intern(domain));
 		SetInt(at[1],ifix);
-		SetBool(at[2],more);
-		Message(add?sym_add:sym_remove,3,at);
+		if(batch)
+			Batch(add?sym_add:sym_remove,2,at,more);
+		else {
+			SetBool(at[2],more);
+			Message(add?sym_add:sym_remove,3,at);
+		}
     }
 };
 
@@ -80,9 +84,9 @@ class Domains
 public:
 
 	Domains()
-        : mode(0),interf(0)
+        : mode(0),interf(0),batch(false)
 	{		
-		Update();
+		Defer();
 	}
 
     void ms_mode(int m) 
@@ -91,7 +95,7 @@ public:
             post("%s - mode must be 0 (off), 1 (browse domains), 2 (registration domains)",thisName());
         else {
             mode = m;
-            Update();
+            Defer();
         }
     }
 
@@ -99,28 +103,40 @@ public:
 	{
 		if(i != interf) {
 			interf = i;
-			Update();
+			Defer();
+		}
+	}
+
+	void ms_batch(bool b)
+	{
+		if(b != batch) {
+			batch = b;
+			Defer();
 		}
 	}
 
 protected:
     int mode;
 	int interf;
+	bool batch;
 
-	void Update()
+	virtual void Update()
 	{
-        Install(mode?new DomainsWorker(interf,mode == 2):NULL);
+        Install(mode?new DomainsWorker(interf,mode == 2,batch):NULL);
 	}
 
     FLEXT_ATTRGET_I(mode)
     FLEXT_CALLSET_I(ms_mode)
 	FLEXT_CALLSET_I(ms_interface)
 	FLEXT_ATTRGET_I(interf)
+	FLEXT_CALLSET_B(ms_batch)
+	FLEXT_ATTRGET_B(batch)
 
 	static void Setup(t_classid c)
 	{
         FLEXT_CADDATTR_VAR(c,"mode",mode,ms_mode);
         FLEXT_CADDATTR_VAR(c,"interface",interf,ms_interface);
+        FLEXT_CADDATTR_VAR(c,"batch",batch,ms_batch);
 	}
 };
 
@@ -0,0 +1,658 @@
+/* 
+zconf - zeroconf networking objects
+
+Copyright (c)2006,2011 Thomas Grill (gr@grrrr.org)
+For information on usage and redistribution, and for a DISCLAIMER OF ALL
+WARRANTIES, see the file, "license.txt," in this distribution.  
+
+$LastChangedRevision$
+$LastChangedDate$
+$LastChangedBy$
+*/
+
+#include "zconf.h"
+#include <algorithm>
+
+namespace zconf {
+
+static Symbol sym_resolve,sym_lost,sym_type,sym_instance,sym_endpoint;
+static Symbol sym_types,sym_instances,sym_endpoints,sym_count;
+
+// inventory of the services on the network: type -> instances -> endpoints
+struct Endpoint
+{
+	Endpoint(Symbol h,Symbol a,int p,int i): host(h),addr(a),port(p),ifix(i) {}
+
+	Symbol host,addr;
+	int port,ifix;
+
+	bool operator ==(const Endpoint &e) const { return host == e.host && addr == e.addr && port == e.port && ifix == e.ifix; }
+};
+
+struct Instance
+{
+	Instance(): rtype(NULL),rdomain(NULL) {}
+
+	std::set<int> ifs; // interfaces the instance is seen on
+	Symbol rtype,rdomain; // as reported by the browser, for resolving
+	std::vector<Endpoint> endpoints;
+};
+
+typedef std::map<Symbol,Instance> Instances;
+
+struct Type
+{
+	std::set<int> ifs; // interfaces the type is seen on
+	Instances instances;
+};
+
+typedef std::pair<Symbol,Symbol> TypeKey; // type, domain
+typedef std::map<TypeKey,Type> Table;
+
+// the whole pipeline runs as helpers on the thread of this worker:
+// one meta query, one browser per type (sharing the daemon operations), and at most maxresolve resolvers waiting for an answer
+// answered resolvers keep running outside of the limit, to report the addresses coming and going
+class InventoryWorker
+	: public Worker
+{
+public:
+	InventoryWorker(int i,int m)
+		: interf(i),maxresolve(m)
+	{}
+
+	// to be called from main thread, copies of parts of the table
+
+	void Types(std::vector<std::pair<TypeKey,int> > &types) const
+	{
+		tablemtx.Lock();
+		for(Table::const_iterator it = table.begin(); it != table.end(); ++it)
+			types.push_back(std::make_pair(it->first,(int)it->second.instances.size()));
+		tablemtx.Unlock();
+	}
+
+	// instances of the types matching type and domain (any if NULL)
+	void Get(Symbol type,Symbol domain,std::vector<std::pair<TypeKey,Instances> > &insts) const
+	{
+		tablemtx.Lock();
+		for(Table::const_iterator it = table.begin(); it != table.end(); ++it)
+			if(Match(it->first.first,type) && Match(it->first.second,domain))
+				insts.push_back(std::make_pair(it->first,it->second.instances));
+		tablemtx.Unlock();
+	}
+
+	void Count(int &types,int &instances,int &endpoints) const
+	{
+		types = instances = endpoints = 0;
+		tablemtx.Lock();
+		for(Table::const_iterator it = table.begin(); it != table.end(); ++it) {
+			++types;
+			instances += (int)it->second.instances.size();
+			for(Instances::const_iterator iit = it->second.instances.begin(); iit != it->second.instances.end(); ++iit)
+				endpoints += (int)iit->second.endpoints.size();
+		}
+		tablemtx.Unlock();
+	}
+
+	// types and domains are matched with or without the trailing dot
+	static bool Match(Symbol s,Symbol pat)
+	{
+		if(!pat || s == pat) return true;
+		const char *a = GetString(s),*b = GetString(pat);
+		size_t la = strlen(a),lb = strlen(b);
+		if(la && a[la-1] == '.') --la;
+		if(lb && b[lb-1] == '.') --lb;
+		return la == lb && !strncmp(a,b,la);
+	}
+
+protected:
+	virtual bool Init()
+	{
+		// passive, the work is done by the helpers
+		meta = NewMetaQuery(interf);
+		Attach(meta,true);
+		fd = -1;
+		return true;
+	}
+
+	virtual void Close()
+	{
+		if(meta) {
+			Detach(meta);
+			meta.reset();
+		}
+		for(Browsers::const_iterator it = browsers.begin(); it != browsers.end(); ++it)
+			Detach(it->second);
+		browsers.clear();
+		browserkeys.clear();
+
+		pending.clear();
+		for(Resolving::const_iterator it = resolving.begin(); it != resolving.end(); ++it)
+			Detach(it->second.resolver);
+		resolving.clear();
+		for(Resolving::const_iterator it = watching.begin(); it != watching.end(); ++it)
+			Detach(it->second.resolver);
+		watching.clear();
+
+		Worker::Close();
+	}
+
+	virtual void OnForward(Worker *w,const t_symbol *sym,int argc,const t_atom *argv)
+	{
+		if(sym == sym_error) {
+			Message(sym,argc,argv);
+			return;
+		}
+
+		if(w == meta.get()) {
+			// add/remove type domain interface more
+			if(argc >= 3)
+				OnType(TypeKey(GetSymbol(argv[0]),GetSymbol(argv[1])),GetAInt(argv[2]),sym == sym_add);
+			return;
+		}
+
+		BrowserKeys::const_iterator bit = browserkeys.find(w);
+		if(bit != browserkeys.end()) {
+			// add/remove name type domain interface more
+			if(argc >= 4)
+				OnInstance(bit->second,GetSymbol(argv[0]),GetSymbol(argv[1]),GetSymbol(argv[2]),GetAInt(argv[3]),sym == sym_add);
+			return;
+		}
+
+		bool answering = true;
+		Resolving::iterator rit = resolving.find(w);
+		if(rit == resolving.end()) {
+			answering = false;
+			rit = watching.find(w);
+			if(rit == watching.end()) return;
+		}
+
+		// resolve/lost name type domain interface host address port, the text record is not kept
+		if((sym != sym_resolve && sym != sym_lost) || argc < 7) return;
+		OnEndpoint(rit->second,Endpoint(GetSymbol(argv[4]),GetSymbol(argv[5]),GetAInt(argv[6]),GetAInt(argv[3])),sym == sym_resolve);
+
+		if(answering && sym == sym_resolve) {
+			// the slot is free for the next one
+			watching.insert(*rit);
+			resolving.erase(rit);
+			Pump();
+		}
+	}
+
+	// a resolver has delivered its answer (or failed), or another helper has failed
+	virtual void OnDone(Worker *w)
+	{
+		if(w == meta.get()) {
+			// no more types, the inventory is done
+			Detach(meta);
+			meta.reset();
+			Done();
+			return;
+		}
+
+		BrowserKeys::iterator bit = browserkeys.find(w);
+		if(bit != browserkeys.end()) {
+			// the instances can't be watched any more, the type gets a new browser after a while
+			// (the meta query only reports changes, so it won't be reported again)
+			TypeKey key = bit->second;
+			Browsers::iterator it = browsers.find(key);
+			Detach(it->second);
+			browsers.erase(it);
+			browserkeys.erase(bit);
+
+			Table::iterator tit = table.find(key);
+			if(tit != table.end()) {
+				Instances &insts = tit->second.instances;
+				while(!insts.empty()) {
+					Instances::iterator iit = insts.begin();
+					Symbol name = iit->first;
+					Cancel(key,name);
+					Prune(key,name,iit->second,-1);
+					tablemtx.Lock();
+					insts.erase(iit);
+					tablemtx.Unlock();
+					Notify(sym_instance,name,key,false);
+				}
+
+				if(retry.empty()) Expire(retrytime);
+				retry.insert(key);
+			}
+			return;
+		}
+
+		Resolving::iterator it = resolving.find(w);
+		if(it != resolving.end()) {
+			Detach(it->second.resolver);
+			resolving.erase(it);
+		}
+		else if((it = watching.find(w)) != watching.end()) {
+			Detach(it->second.resolver);
+			watching.erase(it);
+		}
+		Pump();
+	}
+
+	// browse the types again whose browsers have failed
+	virtual void OnExpire()
+	{
+		std::set<TypeKey> keys;
+		keys.swap(retry);
+		for(std::set<TypeKey>::const_iterator it = keys.begin(); it != keys.end(); ++it)
+			// types that are gone or have been browsed again meanwhile are skipped
+			if(table.find(*it) != table.end()) Browse(*it);
+	}
+
+	int interf;
+	int maxresolve;
+
+private:
+	WorkerPtr meta;
+
+	// types waiting for a new browser
+	std::set<TypeKey> retry;
+	static const double retrytime;
+
+	void Browse(const TypeKey &key)
+	{
+		if(browsers.find(key) != browsers.end()) return;
+		WorkerPtr b = NewBrowser(key.first,key.second,interf);
+		browsers[key] = b;
+		browserkeys[b.get()] = key;
+		Attach(b,true);
+	}
+
+	typedef std::map<TypeKey,WorkerPtr> Browsers;
+	typedef std::map<Worker *,TypeKey> BrowserKeys;
+	Browsers browsers;
+	BrowserKeys browserkeys;
+
+	// resolve pipeline
+	struct Job
+	{
+		Job(const TypeKey &k,Symbol n): key(k),name(n) {}
+		TypeKey key;
+		Symbol name;
+		WorkerPtr resolver;
+	};
+
+	typedef std::map<Worker *,Job> Resolving;
+
+	std::deque<Job> pending;
+	Resolving resolving,watching;
+
+	// written by the worker thread only, so it's read there without locking
+	Table table;
+	mutable ThrMutex tablemtx;
+
+	void OnType(const TypeKey &key,int ifix,bool add)
+	{
+		Table::iterator it = table.find(key);
+		if(add) {
+			bool appeared = it == table.end();
+			tablemtx.Lock();
+			table[key].ifs.insert(ifix);
+			tablemtx.Unlock();
+
+			Browse(key);
+
+			if(appeared) Notify(sym_type,NULL,key,true);
+		}
+		else if(it != table.end()) {
+			tablemtx.Lock();
+			it->second.ifs.erase(ifix);
+			bool vanished = it->second.ifs.empty();
+			tablemtx.Unlock();
+			if(!vanished) return;
+
+			Browsers::iterator bit = browsers.find(key);
+			if(bit != browsers.end()) {
+				browserkeys.erase(bit->second.get());
+				Detach(bit->second);
+				browsers.erase(bit);
+			}
+
+			for(Instances::iterator iit = it->second.instances.begin(); iit != it->second.instances.end(); ++iit) {
+				Cancel(key,iit->first);
+				Prune(key,iit->first,iit->second,-1);
+				Notify(sym_instance,iit->first,key,false);
+			}
+
+			tablemtx.Lock();
+			table.erase(it);
+			tablemtx.Unlock();
+
+			Notify(sym_type,NULL,key,false);
+		}
+	}
+
+	void OnInstance(const TypeKey &key,Symbol name,Symbol rtype,Symbol rdomain,int ifix,bool add)
+	{
+		Table::iterator it = table.find(key);
+		if(it == table.end()) return;
+		Instances &insts = it->second.instances;
+		Instances::iterator iit = insts.find(name);
+
+		if(add) {
+			bool appeared = iit == insts.end();
+			tablemtx.Lock();
+			Instance &inst = insts[name];
+			inst.ifs.insert(ifix);
+			inst.rtype = rtype;
+			inst.rdomain = rdomain;
+			tablemtx.Unlock();
+
+			// each instance is resolved once, when it first appears on any interface
+			if(appeared) {
+				Notify(sym_instance,name,key,true);
+				pending.push_back(Job(key,name));
+				Pump();
+			}
+		}
+		else if(iit != insts.end()) {
+			tablemtx.Lock();
+			iit->second.ifs.erase(ifix);
+			bool vanished = iit->second.ifs.empty();
+			tablemtx.Unlock();
+
+			if(vanished) {
+				Cancel(key,name);
+				Prune(key,name,iit->second,-1);
+				tablemtx.Lock();
+				insts.erase(iit);
+				tablemtx.Unlock();
+				Notify(sym_instance,name,key,false);
+			}
+			else
+				// the endpoints on this interface are gone
+				Prune(key,name,iit->second,ifix);
+		}
+	}
+
+	// remove the endpoints of inst on interface ifix (all for -1)
+	void Prune(const TypeKey &key,Symbol name,Instance &inst,int ifix)
+	{
+		std::vector<Endpoint> &eps = inst.endpoints;
+		for(size_t i = 0; i < eps.size(); ) {
+			if(ifix < 0 || eps[i].ifix == ifix) {
+				Endpoint ep = eps[i];
+				tablemtx.Lock();
+				eps.erase(eps.begin()+i);
+				tablemtx.Unlock();
+				Notify(name,key,ep,false);
+			}
+			else
+				++i;
+		}
+	}
+
+	void OnEndpoint(const Job &job,const Endpoint &ep,bool add)
+	{
+		Table::iterator it = table.find(job.key);
+		if(it == table.end()) return;
+		Instances::iterator iit = it->second.instances.find(job.name);
+		if(iit == it->second.instances.end()) return;
+
+		std::vector<Endpoint> &eps = iit->second.endpoints;
+		std::vector<Endpoint>::iterator eit = std::find(eps.begin(),eps.end(),ep);
+		if(add == (eit != eps.end())) return;
+
+		tablemtx.Lock();
+		if(add)
+			eps.push_back(ep);
+		else
+			eps.erase(eit);
+		tablemtx.Unlock();
+
+		Notify(job.name,job.key,ep,add);
+	}
+
+	// endpoint name type domain host address port interface 1/0
+	void Notify(Symbol name,const TypeKey &key,const Endpoint &ep,bool add)
+	{
+		t_atom at[8];
+		SetSymbol(at[0],name);
+		SetSymbol(at[1],key.first);
+		SetSymbol(at[2],key.second);
+		SetSymbol(at[3],ep.host);
+		SetSymbol(at[4],ep.addr);
+		SetInt(at[5],ep.port);
+		SetInt(at[6],ep.ifix);
+		SetBool(at[7],add);
+		Message(sym_endpoint,8,at);
+	}
+
+	// type type domain 1/0 or instance name type domain 1/0
+	void Notify(Symbol sym,Symbol name,const TypeKey &key,bool add)
+	{
+		t_atom at[4];
+		int n = 0;
+		if(name) SetSymbol(at[n++],name);
+		SetSymbol(at[n++],key.first);
+		SetSymbol(at[n++],key.second);
+		SetBool(at[n++],add);
+		Message(sym,n,at);
+	}
+
+	void Cancel(const TypeKey &key,Symbol name)
+	{
+		for(std::deque<Job>::iterator it = pending.begin(); it != pending.end(); ++it)
+			if(it->key == key && it->name == name) {
+				pending.erase(it);
+				return;
+			}
+
+		for(Resolving::iterator it = resolving.begin(); it != resolving.end(); ++it)
+			if(it->second.key == key && it->second.name == name) {
+				Detach(it->second.resolver);
+				resolving.erase(it);
+				Pump();
+				return;
+			}
+
+		for(Resolving::iterator it = watching.begin(); it != watching.end(); ++it)
+			if(it->second.key == key && it->second.name == name) {
+				Detach(it->second.resolver);
+				watching.erase(it);
+				return;
+			}
+	}
+
+	// start waiting resolves up to the concurrency limit
+	void Pump()
+	{
+		while(!pending.empty() && (maxresolve <= 0 || (int)resolving.size() < maxresolve)) {
+			Job job = pending.front();
+			pending.pop_front();
+
+			Table::const_iterator it = table.find(job.key);
+			if(it == table.end()) continue;
+			Instances::const_iterator iit = it->second.instances.find(job.name);
+			if(iit == it->second.instances.end()) continue;
+
+			job.resolver = NewResolver(GetString(job.name),iit->second.rtype,iit->second.rdomain,interf,false);
+			resolving.insert(std::make_pair(job.resolver.get(),job));
+			Attach(job.resolver,true);
+		}
+	}
+};
+
+const double InventoryWorker::retrytime = 5;
+
+class Inventory
+	: public Base
+{
+	FLEXT_HEADER_S(Inventory,Base,Setup)
+public:
+
+	Inventory()
+		: active(false),interf(0),maxresolve(4)
+	{
+		Defer();
+	}
+
+	void ms_active(bool a)
+	{
+		active = a;
+		Defer();
+	}
+
+	void ms_interface(int i)
+	{
+		if(i != interf) {
+			interf = i;
+			Defer();
+		}
+	}
+
+	void ms_maxresolve(int m)
+	{
+		if(m != maxresolve) {
+			maxresolve = m;
+			Defer();
+		}
+	}
+
+	// count -> count types instances endpoints
+	void m_count()
+	{
+		InventoryWorker *w = (InventoryWorker *)Current();
+		int t = 0,i = 0,e = 0;
+		if(w) w->Count(t,i,e);
+		t_atom at[3];
+		SetInt(at[0],t);
+		SetInt(at[1],i);
+		SetInt(at[2],e);
+		ToOutAnything(GetOutAttr(),sym_count,3,at);
+	}
+
+	// one message per type with its instance count, terminated by an empty one
+	void m_types()
+	{
+		InventoryWorker *w = (InventoryWorker *)Current();
+		if(w) {
+			std::vector<std::pair<TypeKey,int> > types;
+			w->Types(types);
+
+			t_atom at[3];
+			for(std::vector<std::pair<TypeKey,int> >::const_iterator it = types.begin(); it != types.end(); ++it) {
+				SetSymbol(at[0],it->first.first);
+				SetSymbol(at[1],it->first.second);
+				SetInt(at[2],it->second);
+				ToOutAnything(GetOutAttr(),sym_types,3,at);
+			}
+		}
+		ToOutAnything(GetOutAttr(),sym_types,0,NULL);
+	}
+
+	// instances [type [domain]]
+	// one message per instance with its interfaces, terminated by an empty one
+	void m_instances(int argc,const t_atom *argv)
+	{
+		if(argc > 2 || (argc >= 1 && !IsSymbol(argv[0])) || (argc >= 2 && !IsSymbol(argv[1]))) {
+			post("%s - instances [type [domain]]",thisName());
+			return;
+		}
+
+		InventoryWorker *w = (InventoryWorker *)Current();
+		if(w) {
+			std::vector<std::pair<TypeKey,Instances> > insts;
+			w->Get(argc >= 1?GetSymbol(argv[0]):NULL,argc >= 2?GetSymbol(argv[1]):NULL,insts);
+
+			std::vector<t_atom> at;
+			for(std::vector<std::pair<TypeKey,Instances> >::const_iterator it = insts.begin(); it != insts.end(); ++it)
+				for(Instances::const_iterator iit = it->second.begin(); iit != it->second.end(); ++iit) {
+					at.resize(3+iit->second.ifs.size());
+					SetSymbol(at[0],iit->first);
+					SetSymbol(at[1],it->first.first);
+					SetSymbol(at[2],it->first.second);
+					int i = 3;
+					for(std::set<int>::const_iterator ifit = iit->second.ifs.begin(); ifit != iit->second.ifs.end(); ++ifit)
+						SetInt(at[i++],*ifit);
+					ToOutAnything(GetOutAttr(),sym_instances,(int)at.size(),&at[0]);
+				}
+		}
+		ToOutAnything(GetOutAttr(),sym_instances,0,NULL);
+	}
+
+	// endpoints name [type [domain]]
+	// one message per endpoint of the matching instances, terminated by an empty one
+	void m_endpoints(int argc,const t_atom *argv)
+	{
+		if(argc < 1 || argc > 3 || !IsSymbol(argv[0]) || (argc >= 2 && !IsSymbol(argv[1])) || (argc >= 3 && !IsSymbol(argv[2]))) {
+			post("%s - endpoints name [type [domain]]",thisName());
+			return;
+		}
+
+		InventoryWorker *w = (InventoryWorker *)Current();
+		if(w) {
+			Symbol name = GetSymbol(argv[0]);
+			std::vector<std::pair<TypeKey,Instances> > insts;
+			w->Get(argc >= 2?GetSymbol(argv[1]):NULL,argc >= 3?GetSymbol(argv[2]):NULL,insts);
+
+			t_atom at[7];
+			for(std::vector<std::pair<TypeKey,Instances> >::const_iterator it = insts.begin(); it != insts.end(); ++it) {
+				Instances::const_iterator iit = it->second.find(name);
+				if(iit == it->second.end()) continue;
+
+				const std::vector<Endpoint> &eps = iit->second.endpoints;
+				for(std::vector<Endpoint>::const_iterator eit = eps.begin(); eit != eps.end(); ++eit) {
+					SetSymbol(at[0],name);
+					SetSymbol(at[1],it->first.first);
+					SetSymbol(at[2],it->first.second);
+					SetSymbol(at[3],eit->host);
+					SetSymbol(at[4],eit->addr);
+					SetInt(at[5],eit->port);
+					SetInt(at[6],eit->ifix);
+					ToOutAnything(GetOutAttr(),sym_endpoints,7,at);
+				}
+			}
+		}
+		ToOutAnything(GetOutAttr(),sym_endpoints,0,NULL);
+	}
+
+protected:
+	bool active;
+	int interf;
+	int maxresolve;
+
+	virtual void Update()
+	{
+		Install(active?new InventoryWorker(interf,maxresolve):NULL);
+	}
+
+	FLEXT_ATTRGET_B(active)
+	FLEXT_CALLSET_B(ms_active)
+	FLEXT_CALLSET_I(ms_interface)
+	FLEXT_ATTRGET_I(interf)
+	FLEXT_CALLSET_I(ms_maxresolve)
+	FLEXT_ATTRGET_I(maxresolve)
+	FLEXT_CALLBACK(m_count)
+	FLEXT_CALLBACK(m_types)
+	FLEXT_CALLBACK_V(m_instances)
+	FLEXT_CALLBACK_V(m_endpoints)
+
+	static void Setup(t_classid c)
+	{
+		sym_resolve = MakeSymbol("resolve");
+		sym_lost = MakeSymbol("lost");
+		sym_type = MakeSymbol("type");
+		sym_instance = MakeSymbol("instance");
+		sym_endpoint = MakeSymbol("endpoint");
+		sym_types = MakeSymbol("types");
+		sym_instances = MakeSymbol("instances");
+		sym_endpoints = MakeSymbol("endpoints");
+		sym_count = MakeSymbol("count");
+
+		FLEXT_CADDMETHOD_(c,0,sym_count,m_count);
+		FLEXT_CADDMETHOD_(c,0,sym_types,m_types);
+		FLEXT_CADDMETHOD_(c,0,sym_instances,m_instances);
+		FLEXT_CADDMETHOD_(c,0,sym_endpoints,m_endpoints);
+
+		FLEXT_CADDATTR_VAR(c,"active",active,ms_active);
+		FLEXT_CADDATTR_VAR(c,"interface",interf,ms_interface);
+		FLEXT_CADDATTR_VAR(c,"maxresolve",maxresolve,ms_maxresolve);
+	}
+};
+
+FLEXT_LIB("zconf.inventory, zconf",Inventory)
+
+} // namespace
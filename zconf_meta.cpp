@@ -21,18 +21,19 @@ class MetaWorker
 	: public Worker
 {
 public:
-	MetaWorker(int i)
-        : interf(i)
+	MetaWorker(int i,bool b)
+        : interf(i),batch(b)
 	{}
 	
 protected:
 	int interf;
+	bool batch;
 	
 	virtual bool Init()
 	{
 		DNSServiceErrorType err = DNSServiceQueryRecord(
 			&client,
-			0,  // no flags
+			Share(),  // no flags besides connection sharing
             interf < 0?kDNSServiceInterfaceIndexLocalOnly:kDNSServiceInterfaceIndexAny, 
 			kServiceMetaQueryName,  // meta-query record name
 			kDNSServiceType_PTR,  // DNS PTR Record
@@ -69,12 +70,12 @@ private:
         MetaWorker *w = (MetaWorker *)context;
 
 		if(LIKELY(errorCode == kDNSServiceErr_NoError)) {
-		    char domain[MAX_DOMAIN_NAME]    = "";
-			char type[MAX_DOMAIN_NAME]      = "";
+			// escaping can expand the name up to four times
+		    char domain[kDNSServiceMaxDomainName];
+			char type[kDNSServiceMaxDomainName];
 		    /* Get the type and domain from the discovered PTR record. */
-			conv_type_domain(rdata, rdlen, type, domain);        
-
-			w->OnMeta(type,domain,interf,(flags & kDNSServiceFlagsAdd) != 0,(flags & kDNSServiceFlagsMoreComing) != 0);
+			if(LIKELY(conv_type_domain(rdata, rdlen, type, sizeof type, domain, sizeof domain)))
+				w->OnMeta(type,domain,interf,(flags & kDNSServiceFlagsAdd) != 0,(flags & kDNSServiceFlagsMoreComing) != 0);
 		} 
 		else
 			w->OnError(errorCode);
@@ -84,14 +85,23 @@ private:
     void OnMeta(const char *type,const char *domain,int interf,bool add,bool more)
     {
         t_atom at[4]; 
-		SetString(at[0],type);
-		SetString(at[1],DNSUnescape(domain).c_str());
+		SetSymbol(at[0],Intern(type,false));
+		SetSymbol(at[1],Intern(domain));
 		SetInt(at[2],interf);
-        SetBool(at[3],more);
-		Message(add?sym_add:sym_remove,4,at);
+		if(batch)
+			Batch(add?sym_add:sym_remove,3,at,more);
+		else {
+	        SetBool(at[3],more);
+			Message(add?sym_add:sym_remove,4,at);
+		}
     }
 };
 
+WorkerPtr NewMetaQuery(int interf)
+{
+    return WorkerPtr(new MetaWorker(interf,false));
+}
+
 class Meta
 	: public Base
 {
@@ -99,43 +109,55 @@ class Meta
 public:
 
 	Meta()
-		: active(false),interf(0)
+		: active(false),interf(0),batch(false)
 	{
-		Update();
+		Defer();
 	}
 
 	void ms_active(bool a)
 	{
 		active = a;
-		Update();
+		Defer();
 	}
 
 	void ms_interface(int i)
 	{
 		if(i != interf) {
 			interf = i;
-			Update();
+			Defer();
+		}
+	}
+
+	void ms_batch(bool b)
+	{
+		if(b != batch) {
+			batch = b;
+			Defer();
 		}
 	}
 
 protected:
 	bool active;
 	int interf;
+	bool batch;
 
-	void Update()
+	virtual void Update()
 	{
-        Install(active?new MetaWorker(interf):NULL);
+        Install(active?new MetaWorker(interf,batch):NULL);
 	}
 
 	FLEXT_ATTRGET_B(active)
 	FLEXT_CALLSET_B(ms_active)
 	FLEXT_CALLSET_I(ms_interface)
 	FLEXT_ATTRGET_I(interf)
+	FLEXT_CALLSET_B(ms_batch)
+	FLEXT_ATTRGET_B(batch)
 
 	static void Setup(t_classid c)
 	{
 		FLEXT_CADDATTR_VAR(c,"active",active,ms_active);
 		FLEXT_CADDATTR_VAR(c,"interface",interf,ms_interface);
+		FLEXT_CADDATTR_VAR(c,"batch",batch,ms_batch);
 	}
 };
 
@@ -12,27 +12,274 @@ $LastChangedBy$
 
 #include "zconf.h"
 #include <cstdio>
+#include <cstdlib>
+#include <map>
+#include <algorithm>
 
 namespace zconf {
 
-static Symbol sym_resolve,sym_txtrecord;
+static Symbol sym_resolve,sym_txtrecord,sym_timeout,sym_lost;
+
+// output of text record values
+enum { txt_symbol = 0,txt_number = 1,txt_bytes = 2 };
+
+// result of a service resolution, as kept by the workers and the cache
+struct Resolution
+{
+    Resolution(): port(0),ifix(0),expires(0) {}
+
+    std::string name,type,domain,host,txt;
+    int port,ifix;
+    std::vector<std::string> addresses;
+    // absolute expiry time in seconds (from the address record TTLs)
+    double expires;
+
+    bool Has(const std::string &addr) const { return std::find(addresses.begin(),addresses.end(),addr) != addresses.end(); }
+
+    // output atoms for one address, returns count
+    // symbols are taken from sc in the worker thread
+    // with held given, names and address are output as handles instead
+    int Atoms(t_atom *at,const char *ipaddr,SymbolCache *sc = NULL,HandleSet *held = NULL) const
+    {
+        if(held) {
+            char buf[kDNSServiceMaxDomainName];
+            NameAtom(at[0],sc,held); // service name
+            flext::SetSymbol(at[1],sc->Get(type.c_str(),false)); // type
+            flext::SetSymbol(at[2],sc->Get(domain.c_str())); // domain
+            flext::SetInt(at[4],held->Hold(DNSUnescape(host.c_str(),buf,sizeof buf))); // host name
+        }
+        else if(sc) {
+            NameAtom(at[0],sc); // service name
+            flext::SetSymbol(at[1],sc->Get(type.c_str(),false)); // type
+            flext::SetSymbol(at[2],sc->Get(domain.c_str())); // domain
+            flext::SetSymbol(at[4],sc->Get(host.c_str())); // host name
+        }
+        else {
+            char buf[kDNSServiceMaxDomainName];
+            flext::SetString(at[0],DNSUnescape(name.c_str(),buf,sizeof buf)); // service name
+            flext::SetString(at[1],type.c_str()); // type
+            flext::SetString(at[2],DNSUnescape(domain.c_str(),buf,sizeof buf)); // domain
+            flext::SetString(at[4],DNSUnescape(host.c_str(),buf,sizeof buf)); // host name
+        }
+		flext::SetInt(at[3],ifix);
+        if(held)
+            flext::SetInt(at[5],held->Hold(ipaddr)); // ip address
+        else
+            flext::SetString(at[5],ipaddr); // ip address
+		flext::SetInt(at[6],port);
+        flext::SetBool(at[7],HasTxt());
+        return 8;
+    }
+
+    // service name atom, as in the address output (worker thread only)
+    void NameAtom(t_atom &at,SymbolCache *sc,HandleSet *held = NULL) const
+    {
+        if(held) {
+            char buf[kDNSServiceMaxDomainName];
+            flext::SetInt(at,held->Hold(DNSUnescape(name.c_str(),buf,sizeof buf)));
+        }
+        else
+            flext::SetSymbol(at,sc->Get(name.c_str()));
+    }
+
+    bool HasTxt() const { return !txt.empty() && txt[0]; }
+
+    // text record as one list of key count values... for all items
+    // values are output as symbols, numbers (where possible) or raw bytes
+    // items without a value have count 0
+    // with held given, symbol values are output as handles instead
+    void TxtAtoms(std::vector<t_atom> &at,int mode,HandleSet *held = NULL) const
+    {
+        const void *txtRecord = txt.data();
+        uint16_t txtLen = (uint16_t)txt.length();
+        uint16_t cnt = TXTRecordGetCount(txtLen,txtRecord);
+        at.clear();
+        at.reserve(cnt*3);
+
+        for(uint16_t i = 0; i < cnt; ++i) {
+            char key[256];
+            uint8_t len;
+            const void *value;
+            if(TXTRecordGetItemAtIndex(txtLen,txtRecord,i,sizeof key,key,&len,&value) != kDNSServiceErr_NoError)
+                break;
+
+            size_t ix = at.size();
+            at.resize(ix+2);
+            flext::SetString(at[ix],key);
+
+            // value is NULL for items without '='
+            const char *v = (const char *)value;
+            if(!v)
+                flext::SetInt(at[ix+1],0);
+            else if(mode == txt_bytes) {
+                flext::SetInt(at[ix+1],len);
+                at.resize(ix+2+len);
+                for(int j = 0; j < len; ++j)
+                    flext::SetInt(at[ix+2+j],(unsigned char)v[j]);
+            }
+            else {
+                // the value isn't null-terminated
+                char buf[256];
+                memcpy(buf,v,len);
+                buf[len] = 0;
+
+                flext::SetInt(at[ix+1],1);
+                at.resize(ix+3);
+                char *end;
+                double d;
+                if(mode == txt_number && len && (d = strtod(buf,&end),end == buf+len))
+                    flext::SetFloat(at[ix+2],(float)d);
+                else
+                    if(held)
+                        flext::SetInt(at[ix+2],held->Hold(buf));
+                    else
+                        flext::SetString(at[ix+2],buf);
+            }
+        }
+    }
+};
+
+// process-wide cache of resolutions, shared by all zconf.resolve objects
+// written by the resolve workers, read by the main thread
+class ResolveCache
+{
+public:
+    ResolveCache(): puts(0) {}
+
+    struct Key
+    {
+        Key(const char *n,Symbol t,Symbol d,int i): name(n),type(t),domain(d),interf(i) {}
+
+        std::string name;
+        Symbol type,domain;
+        int interf;
+
+        bool operator <(const Key &k) const
+        {
+            if(type != k.type) return type < k.type;
+            int c = name.compare(k.name);
+            if(c) return c < 0;
+            if(domain != k.domain) return domain < k.domain;
+            return interf < k.interf;
+        }
+    };
+
+    // get a valid entry (not expired and with known addresses)
+    bool Get(const Key &k,Resolution &r)
+    {
+        bool ok = false;
+        mtx.Lock();
+        Entries::iterator it = entries.find(k);
+        if(it != entries.end()) {
+            if(it->second.expires > flext::GetOSTime()) {
+                r = it->second;
+                ok = !r.addresses.empty();
+            }
+            else
+                entries.erase(it);
+        }
+        mtx.Unlock();
+        return ok;
+    }
+
+    void Put(const Key &k,const Resolution &r)
+    {
+        mtx.Lock();
+        entries[k] = r;
+        if(++puts%256 == 0) Purge();
+        mtx.Unlock();
+    }
+
+    void Remove(const Key &k)
+    {
+        mtx.Lock();
+        entries.erase(k);
+        mtx.Unlock();
+    }
+
+private:
+    typedef std::map<Key,Resolution> Entries;
+
+    // drop expired entries, mutex must be held
+    void Purge()
+    {
+        double now = flext::GetOSTime();
+        for(Entries::iterator it = entries.begin(); it != entries.end(); )
+            if(it->second.expires <= now)
+                entries.erase(it++);
+            else
+                ++it;
+    }
+
+    flext::ThrMutex mtx;
+    Entries entries;
+    unsigned int puts;
+};
+
+static ResolveCache cache;
+
+// lifetime of entries if no record TTL is known
+static const double cachettl = 120;
+
+// time for a resolver made by NewResolver to come up with an answer (stale instances never answer)
+static const double helpertimeout = 10;
+
+#ifdef FLEXT_DEBUG
+// fault injection for testing: with ZCONF_FAIL_RESOLVE set, all resolve operations fail (see test/resolve-errors.pd)
+static const bool failresolve = getenv("ZCONF_FAIL_RESOLVE") != NULL;
+#endif
 
 class ResolveWorker
 	: public Worker
 {
 public:
-	ResolveWorker(Symbol n,Symbol t,Symbol d,int i)
-        : name(n),type(t),domain(d),interf(i)
-	{}
+	// cached is what has already been output from the cache
+	// with oneshot set, the worker is done after the first complete answer
+	// all messages are tagged with tg (if given)
+	// with h given, names, addresses and text values are output as handles referenced by h
+	ResolveWorker(const char *n,Symbol t,Symbol d,int i,const Resolution &cached,bool o = false,Symbol tg = NULL,int tm = txt_symbol,const HandleSetPtr &h = HandleSetPtr())
+        : helper(false)
+        , name(n),type(t),domain(d),interf(i)
+        , oneshot(o),finished(false)
+        , txtmode(tm),held(h)
+        , addrref(NULL)
+        , res(cached),txtsent(!cached.addresses.empty())
+	{
+        tag = tg;
+    }
+
+    // can be called from the main thread
+    bool Finished() const { return finished; }
+    Symbol RequestKey() const { return tag; }
+
+    // made by NewResolver, reporting to a target:
+    // the text record is prefixed with the service name and vanished addresses are reported
+    bool helper;
 	
 protected:
+	virtual unsigned int Shard() const { return Hash(type,domain); }
+
 	virtual bool Init()
 	{
+		// resolve and address lookup share one connection
+		DNSServiceFlags flags = Share(true);
+		if(!conn) {
+			Finish();
+			return false;
+		}
+
+#ifdef FLEXT_DEBUG
+		if(UNLIKELY(failresolve)) {
+			OnError(kDNSServiceErr_Unknown);
+			return false;
+		}
+#endif
+
 		DNSServiceErrorType err = DNSServiceResolve(
             &client,
-			0, // default renaming behaviour 
+			flags, // subordinate of conn
             interf < 0?kDNSServiceInterfaceIndexLocalOnly:kDNSServiceInterfaceIndexAny, 
-			GetString(name),
+			name.c_str(),
 			GetString(type),
 			domain?GetString(domain):"local",
 			callback, this
@@ -42,6 +289,7 @@ protected:
 
 		if(LIKELY(err == kDNSServiceErr_NoError)) {
 			FLEXT_ASSERT(client);
+			if(helper) Expire(helpertimeout);
 			return Worker::Init();
 		}
 		else {
@@ -49,9 +297,57 @@ protected:
 			return false;
 		}
 	} 
+
+	// a oneshot worker is done after an error, too, as is a helper (its target has to know)
+	virtual void OnError(DNSServiceErrorType error)
+	{
+		Worker::OnError(error);
+		if(oneshot)
+			Finish();
+		else if(helper)
+			Done();
+	}
+
+	// a helper without an answer in time is given up, so that it doesn't hold up its target
+	virtual void OnExpire()
+	{
+		if(finished) return;
+		if(res.addresses.empty())
+			OnError(kDNSServiceErr_Timeout);
+		else
+			// incomplete, but an answer
+			Finish();
+	}
+
+	virtual void Close()
+	{
+		if(addrref) {
+			DNSServiceRefDeallocate(addrref);
+			addrref = NULL;
+		}
+
+		Worker::Close();
+	}
 	
-	Symbol name,type,domain;
+	std::string name;
+	Symbol type,domain;
     int interf;
+    bool oneshot;
+    Atomic<bool> finished; // read by the main thread
+    int txtmode;
+    // references of the handles in our output (NULL for output as symbols)
+    // owned by the requester, so the handles remain valid after we're done
+    HandleSetPtr held;
+
+	// address lookup of the resolved host
+	DNSServiceRef addrref;
+
+	// current resolve result
+	Resolution res;
+	bool txtsent;
+	std::vector<t_atom> txtatoms;
+
+    ResolveCache::Key Key() const { return ResolveCache::Key(name.c_str(),type,domain,interf); }
 
 private:
     static void DNSSD_API callback(
@@ -75,33 +371,8 @@ private:
 
 			union { uint16_t s; unsigned char b[2]; } oport = { opaqueport };
 			uint16_t port = ((uint16_t)oport.b[0]) << 8 | oport.b[1];
-		
-			char temp[256],*t,*t1;
-			strcpy(temp,fullname);
-			
-			t = getdot(t1 = temp);
-			FLEXT_ASSERT(t); // after service name           
-            *t = 0;
-			const char *srvname = t1; // service name
-
-			t = getdot(t1 = t+1);
-			FLEXT_ASSERT(t); // middle dot in type
-			t = getdot(t+1);
-			FLEXT_ASSERT(t); // after type
-			*t = 0;
-			const char *type = t1; // type
-
-			const char *domain = t+1; // domain
-
-//            post("Resolve name %s",hosttarget);
-            const hostent *he = gethostbyname(hosttarget);
-            if(he && he->h_length == 4) {
-                const unsigned char *addr = (unsigned char *)he->h_addr_list[0];
-                char ipaddr[16];
-                sprintf(ipaddr,"%03i.%03i.%03i.%03i",addr[0],addr[1],addr[2],addr[3]);
-//                post("Resolve %s %i",ipaddr,port);
-                w->OnResolve(srvname,hosttarget,ipaddr,type,domain,port,ifIndex,txtLen,(char *)txtRecord);
-            }
+
+			w->OnResolve(fullname,hosttarget,port,ifIndex,txtLen,txtRecord);
 		}
 		else
 			w->OnError(errorCode);
@@ -109,40 +380,184 @@ private:
 		// remove immediately
 //		w->shouldexit = true;
     }
-	
+
+    static void DNSSD_API addrcallback(
+        DNSServiceRef sdRef,
+        DNSServiceFlags flags,
+        uint32_t ifIndex,
+        DNSServiceErrorType errorCode,
+        const char *hostname,
+        const struct sockaddr *address,
+        uint32_t ttl,
+        void *context)
+    {
+        ResolveWorker *w = (ResolveWorker *)context;
+
+		if(LIKELY(errorCode == kDNSServiceErr_NoError)) {
+            char ipaddr[NI_MAXHOST];
+            if(FormatAddress(address,ipaddr,sizeof ipaddr))
+                w->OnAddress(ipaddr,ttl,(flags & kDNSServiceFlagsAdd) != 0,(flags & kDNSServiceFlagsMoreComing) != 0);
+        }
+        else
+			w->OnError(errorCode);
+    }
+
 	// can be called from a secondary thread
-    void OnResolve(const char *srvname,const char *hostname,const char *ipaddr,const char *type,const char *domain,int port,int ifix,int txtLen,const char *txtRecord)
-    {
-        bool hastxtrec = txtRecord && txtLen && *txtRecord;
-		t_atom at[8];
-        SetString(at[0],DNSUnescape(srvname).c_str()); // host name
-        SetString(at[1],type); // type
-        SetString(at[2],DNSUnescape(domain).c_str()); // domain
-		SetInt(at[3],ifix);
-        SetString(at[4],DNSUnescape(hostname).c_str()); // host name
-        SetString(at[5],ipaddr); // ip address
-		SetInt(at[6],port);
-        SetBool(at[7],hastxtrec);
-		Message(sym_resolve,8,at);
-        if(hastxtrec) {
-            for(int i = 0; i < txtLen; ++i) {
-                char txt[256];
-                int l = (txtRecord)[i];
-                memcpy(txt,txtRecord+i+1,l);
-                txt[l] = 0;
-                char *ass = strchr(txt,'=');
-                if(ass) { 
-                    *ass = 0;
-                    SetString(at[1],ass+1);
+    void OnResolve(const char *fullname,const char *hosttarget,int p,int ifindex,int txtLen,const unsigned char *txtRecord)
+    {
+        if(UNLIKELY(finished)) return;
+
+		char temp[kDNSServiceMaxDomainName],*t,*t1;
+		strncpy(temp,fullname,sizeof temp);
+		temp[sizeof temp-1] = 0;
+		
+        Resolution r;
+
+		t = getdot(t1 = temp);
+		if(!t) return; // after service name           
+        *t = 0;
+		r.name = t1; // service name
+
+		t = getdot(t1 = t+1);
+		if(!t) return; // middle dot in type
+		t = getdot(t+1);
+		if(!t) return; // after type
+		*t = 0;
+		r.type = t1; // type
+
+		r.domain = t+1; // domain
+
+        r.host = hosttarget;
+        r.port = p;
+        r.ifix = ifindex;
+        r.txt.assign((const char *)txtRecord,txtLen);
+
+        bool samehost = r.host == res.host && r.port == res.port && r.ifix == res.ifix && r.name == res.name;
+        if(samehost) {
+            // only the text record may have changed
+            if(r.txt != res.txt) {
+                res.txt = r.txt;
+                if(!res.addresses.empty()) {
+                    SendTxt();
+                    Refresh();
                 }
-                SetString(at[0],txt);
-                Message(sym_txtrecord,ass?2:1,at);
-                i += l;
+                else
+                    txtsent = false;
             }
-    		Message(sym_txtrecord,0,NULL);
+            // addresses being looked up already
+            // addresses seeded from the cache still need watching, OnAddress doesn't report them again
+            if(addrref) return;
+        }
+        else {
+            res = r;
+            txtsent = false;
+            cache.Remove(Key());
+        }
+
+        // (re)start the address lookup, addresses are reported as they arrive
+        if(addrref) DNSServiceRefDeallocate(addrref);
+        addrref = conn;
+        DNSServiceErrorType err = DNSServiceGetAddrInfo(
+            &addrref,
+            kDNSServiceFlagsShareConnection,
+            ifindex,
+            kDNSServiceProtocol_IPv4|kDNSServiceProtocol_IPv6,
+            hosttarget,
+            addrcallback, this
+        );
+
+        if(UNLIKELY(err != kDNSServiceErr_NoError)) {
+            addrref = NULL;
+            OnError(err);
         }
     }
 
+	// can be called from a secondary thread
+    void OnAddress(const char *ipaddr,uint32_t ttl,bool add,bool more)
+    {
+        if(UNLIKELY(finished)) return;
+
+        double expires = GetOSTime()+(ttl?ttl:cachettl);
+
+        if(!add) {
+            std::vector<std::string>::iterator it = std::find(res.addresses.begin(),res.addresses.end(),std::string(ipaddr));
+            if(it != res.addresses.end()) {
+                res.addresses.erase(it);
+                if(helper) {
+                    t_atom at[8];
+                    int n = res.Atoms(at,ipaddr,&Symbols(),held.get());
+                    Message(sym_lost,n,at);
+                }
+            }
+            Refresh();
+            return;
+        }
+
+        // addresses that are already known (e.g. from the cache) are not reported again
+        if(!res.Has(ipaddr)) {
+            res.addresses.push_back(ipaddr);
+
+            t_atom at[8];
+            int n = res.Atoms(at,ipaddr,&Symbols(),held.get());
+            Message(sym_resolve,n,at);
+
+            // text record is sent along with the first address
+            if(!txtsent) SendTxt();
+        }
+
+        // the shortest record lifetime determines the entry lifetime
+        if(res.addresses.size() == 1 || expires < res.expires) res.expires = expires;
+        Refresh();
+
+        // the answer is complete when no more addresses are coming
+        if(!more) Finish();
+    }
+
+    // a oneshot worker is done after an answer or an error
+    void Finish()
+    {
+        if(oneshot && !finished) {
+            finished = true;
+            Done();
+        }
+    }
+
+    void SendTxt()
+    {
+        if(res.HasTxt()) {
+            res.TxtAtoms(txtatoms,txtmode,held.get());
+            if(helper) {
+                // several resolvers can report to the same target
+                txtatoms.insert(txtatoms.begin(),t_atom());
+                res.NameAtom(txtatoms[0],&Symbols(),held.get());
+            }
+            Message(sym_txtrecord,(int)txtatoms.size(),txtatoms.empty()?NULL:&txtatoms[0]);
+        }
+        txtsent = true;
+    }
+
+    // update the cache with the current result
+    void Refresh()
+    {
+        if(res.addresses.empty())
+            cache.Remove(Key());
+        else
+            cache.Put(Key(),res);
+    }
+
+    static bool FormatAddress(const sockaddr *address,char *buf,size_t len)
+    {
+        socklen_t salen;
+        if(address->sa_family == AF_INET)
+            salen = sizeof(sockaddr_in);
+        else if(address->sa_family == AF_INET6)
+            salen = sizeof(sockaddr_in6);
+        else
+            return false;
+        // numeric form, IPv6 link-local addresses include the scope
+        return getnameinfo(address,salen,buf,(socklen_t)len,NULL,0,NI_NUMERICHOST) == 0;
+    }
+
     static char *getdot(char *txt)
     {
         bool escaped = false;      
@@ -165,6 +580,13 @@ private:
     }
 };
 
+WorkerPtr NewResolver(const char *name,Symbol type,Symbol domain,int interf,bool oneshot,int txtmode,const HandleSetPtr &held)
+{
+    ResolveWorker *w = new ResolveWorker(name,type,domain,interf,Resolution(),oneshot,NULL,txtmode,held);
+    w->helper = true;
+    return WorkerPtr(w);
+}
+
 
 class Resolve
 	: public Base
@@ -172,35 +594,323 @@ class Resolve
 	FLEXT_HEADER_S(Resolve,Base,Setup)
 public:
 
-	Resolve() {}
+	Resolve()
+        : oneshot(false),timeout(5),txtmode(txt_symbol),handles(false)
+        , generation(0),currentgen(0),nexttime(0)
+    {
+        timer.SetCallback(timerfun);
+    }
+
+	~Resolve()
+	{
+		for(Requests::const_iterator it = requests.begin(); it != requests.end(); ++it)
+			Stop(it->second.worker);
+	}
 
 	void m_resolve(int argc,const t_atom *argv)
 	{
-        if(argc == 0)
+        if(argc == 0) {
             Install(NULL);
-        else if(argc < 2 || !IsSymbol(argv[0]) || !IsSymbol(argv[1])) {
-			post("%s - %s: type (like _ssh._tcp or _osc._udp) and servicename must be given",thisName(),GetString(thisTag()));
-		}
+            held.erase(NULL);
+        }
         else {
-		    Symbol type = GetSymbol(argv[0]);
-		    Symbol name = GetASymbol(argv[1]);
-            Symbol domain = argc >= 3?GetASymbol(argv[2]):NULL;
-            int interf = argc >= 4?GetAInt(argv[3]):0;
+            ResolveWorker *w;
+            if(Request(argc,argv,NULL,w)) {
+                Install(w);
+                currentgen = ++generation;
+                if(w) Schedule(NULL,currentgen);
+            }
+        }
+	}
 
-		    Install(new ResolveWorker(name,type,domain,interf));
+	// request key type name [domain] [interface]
+	// several requests can be in flight, the replies are tagged with the key
+	void m_request(int argc,const t_atom *argv)
+	{
+        if(argc < 1 || !IsSymbol(argv[0])) {
+			post("%s - %s: request key must be given",thisName(),GetString(thisTag()));
+            return;
+        }
+
+        Symbol key = GetSymbol(argv[0]);
+        ResolveWorker *w;
+        if(Request(argc-1,argv+1,key,w)) {
+            // a request with the same key is replaced
+            Cancel(key);
+            // answered requests which haven't been released at dispatch
+            Sweep();
+            if(w) {
+                Req &r = requests[key];
+                r.worker.reset(w);
+                r.gen = ++generation;
+                Start(r.worker);
+                Schedule(key,r.gen);
+            }
+        }
+	}
+
+	// cancel [key], without a key all requests are cancelled
+	void m_cancel(int argc,const t_atom *argv)
+	{
+        if(argc == 0) {
+            for(Requests::const_iterator it = requests.begin(); it != requests.end(); ++it)
+                Stop(it->second.worker);
+            requests.clear();
+            // the handles of the unkeyed resolve are kept
+            for(Held::iterator it = held.begin(); it != held.end(); )
+                if(it->first) held.erase(it++); else ++it;
+        }
+        else if(IsSymbol(argv[0])) {
+            Cancel(GetSymbol(argv[0]));
+            held.erase(GetSymbol(argv[0]));
         }
+        else
+			post("%s - %s: request key must be a symbol",thisName(),GetString(thisTag()));
 	}
 
+    void ms_txtmode(int m)
+    {
+        if(m < txt_symbol || m > txt_bytes)
+			post("%s - txtmode must be 0 (symbols), 1 (numbers where possible), 2 (raw bytes)",thisName());
+        else
+            txtmode = m;
+    }
+
+    void ms_timeout(float t)
+    {
+        if(t < 0)
+			post("%s - timeout must be >= 0 (0 for none)",thisName());
+        else
+            timeout = t;
+    }
+
 protected:
 
+    // with oneshot set, resolves are released after the first complete answer or the timeout
+    bool oneshot;
+    float timeout;
+
+    // output of text record values
+    int txtmode;
+
+    // output names, addresses and text values as handles
+    bool handles;
+
+    // the generation tells a request from a former one with the same key
+    struct Req
+    {
+        Req(): gen(0) {}
+        WorkerPtr worker;
+        unsigned int gen;
+    };
+
+    typedef std::map<Symbol,Req> Requests;
+    Requests requests;
+    unsigned int generation,currentgen;
+
+    // references of the handles output for a request key (NULL for resolve)
+    // kept until the key is requested again or cancelled, so they outlast the daemon operation
+    typedef std::map<Symbol,HandleSetPtr> Held;
+    Held held;
+
+    void Cancel(Symbol key)
+    {
+        Requests::iterator it = requests.find(key);
+        if(it != requests.end()) {
+            Stop(it->second.worker);
+            requests.erase(it);
+        }
+    }
+
+    // an answered oneshot request can be released when all its messages are out
+    static bool Spent(const Worker *w)
+    {
+        return static_cast<const ResolveWorker *>(w)->Finished() && !Waiting(w);
+    }
+
+    // release the spent requests
+    void Sweep()
+    {
+        for(Requests::iterator it = requests.begin(); it != requests.end(); )
+            if(Spent(it->second.worker.get())) {
+                Stop(it->second.worker);
+                requests.erase(it++);
+            }
+            else
+                ++it;
+    }
+
+    virtual bool Dispatch(Worker *w)
+    {
+        if(Base::Dispatch(w)) return true;
+
+        // the worker may finish after its last message has been output, this is caught by Sweep
+        Symbol key = static_cast<ResolveWorker *>(w)->RequestKey();
+        if(key && Spent(w)) {
+            Requests::iterator it = requests.find(key);
+            if(it != requests.end() && it->second.worker.get() == w) {
+                Stop(it->second.worker);
+                requests.erase(it);
+            }
+        }
+        return false;
+    }
+
+    // parse type name [domain] [interface] and make a worker with messages tagged by key
+    // w is NULL if the request has been answered from the cache alone
+    bool Request(int argc,const t_atom *argv,Symbol key,ResolveWorker *&w)
+    {
+        if(argc < 2 || !IsSymbol(argv[0]) || !IsSymbol(argv[1])) {
+			post("%s - %s: type (like _ssh._tcp or _osc._udp) and servicename must be given",thisName(),GetString(thisTag()));
+            return false;
+		}
+
+        Symbol type = GetSymbol(argv[0]);
+        const char *name = GetString(GetASymbol(argv[1]));
+        Symbol domain = argc >= 3?GetASymbol(argv[2]):NULL;
+        int interf = argc >= 4?GetAInt(argv[3]):0;
+
+        // answer from the cache right away, the worker keeps it up to date
+        // handles are only made by the worker, so the cache isn't used for them
+        Resolution cached;
+        if(!handles && cache.Get(ResolveCache::Key(name,type,domain,interf),cached)) {
+            Output(cached,key);
+            if(oneshot) {
+                w = NULL;
+                return true;
+            }
+        }
+
+        // the handles of a former request with the same key are released
+        HandleSetPtr h;
+        if(handles) {
+            h.reset(new HandleSet);
+            held[key] = h;
+        }
+        else
+            held.erase(key);
+
+        w = new ResolveWorker(name,type,domain,interf,cached,oneshot,key,txtmode,h);
+        return true;
+    }
+
+    void Output(const Resolution &r,Symbol key)
+    {
+        // room for the key in front
+		t_atom at[9],*a = key?at+1:at;
+        int k = key?1:0;
+        if(key) SetSymbol(at[0],key);
+
+        for(std::vector<std::string>::const_iterator it = r.addresses.begin(); it != r.addresses.end(); ++it)
+		    ToOutAnything(GetOutAttr(),sym_resolve,k+r.Atoms(a,it->c_str()),at);
+
+        if(r.HasTxt()) {
+            std::vector<t_atom> txt;
+            r.TxtAtoms(txt,txtmode);
+            if(key) txt.insert(txt.begin(),at[0]);
+            ToOutAnything(GetOutAttr(),sym_txtrecord,(int)txt.size(),txt.empty()?NULL:&txt[0]);
+        }
+    }
+
+    // oneshot resolves which have to answer in time
+    struct Deadline
+    {
+        Deadline(Symbol k,unsigned int g,double t): key(k),gen(g),time(t) {}
+        Symbol key;
+        unsigned int gen; // of the request
+        double time;
+    };
+
+    std::vector<Deadline> deadlines;
+    double nexttime;
+    Timer timer;
+
+    void Schedule(Symbol key,unsigned int gen)
+    {
+        if(!oneshot || !timeout) return;
+        double t = GetOSTime()+timeout;
+        deadlines.push_back(Deadline(key,gen,t));
+        // the timeout might have been shortened meanwhile
+        if(deadlines.size() == 1 || t < nexttime) {
+            nexttime = t;
+            timer.Delay(timeout,this);
+        }
+    }
+
+    static void timerfun(void *data) { static_cast<Resolve *>(data)->OnTimer(); }
+
+    void OnTimer()
+    {
+        double now = GetOSTime(),next = 0;
+        Sweep();
+
+        for(std::vector<Deadline>::iterator it = deadlines.begin(); it != deadlines.end(); ) {
+            ResolveWorker *w = Running(*it);
+            if(!w || w->Finished())
+                // answered, cancelled or replaced
+                it = deadlines.erase(it);
+            else if(it->time <= now) {
+                Symbol key = it->key;
+                it = deadlines.erase(it);
+
+                // release the daemon operation
+                if(key) Cancel(key); else Install(NULL);
+
+                t_atom at;
+                if(key) SetSymbol(at,key);
+                ToOutAnything(GetOutAttr(),sym_timeout,key?1:0,&at);
+            }
+            else {
+                if(!next || it->time < next) next = it->time;
+                ++it;
+            }
+        }
+
+        if(next) {
+            nexttime = next;
+            timer.Delay(next-now,this);
+        }
+    }
+
+    // the worker of d if it's still in use
+    ResolveWorker *Running(const Deadline &d) const
+    {
+        Worker *w;
+        if(d.key) {
+            Requests::const_iterator it = requests.find(d.key);
+            w = it != requests.end() && it->second.gen == d.gen?it->second.worker.get():NULL;
+        }
+        else
+            w = currentgen == d.gen?Current():NULL;
+        return static_cast<ResolveWorker *>(w);
+    }
+
+	FLEXT_ATTRVAR_B(oneshot)
+	FLEXT_CALLSET_F(ms_timeout)
+	FLEXT_ATTRGET_F(timeout)
+	FLEXT_CALLSET_I(ms_txtmode)
+	FLEXT_ATTRGET_I(txtmode)
+	FLEXT_ATTRVAR_B(handles)
+
 	FLEXT_CALLBACK_V(m_resolve)
+	FLEXT_CALLBACK_V(m_request)
+	FLEXT_CALLBACK_V(m_cancel)
 
 	static void Setup(t_classid c)
 	{
 		sym_resolve = MakeSymbol("resolve");
 		sym_txtrecord = MakeSymbol("txtrecord");
+		sym_timeout = MakeSymbol("timeout");
+		sym_lost = MakeSymbol("lost");
 	
 		FLEXT_CADDMETHOD_(c,0,sym_resolve,m_resolve);
+		FLEXT_CADDMETHOD_(c,0,"request",m_request);
+		FLEXT_CADDMETHOD_(c,0,"cancel",m_cancel);
+
+		FLEXT_CADDATTR_VAR1(c,"oneshot",oneshot);
+		FLEXT_CADDATTR_VAR(c,"timeout",timeout,ms_timeout);
+		FLEXT_CADDATTR_VAR(c,"txtmode",txtmode,ms_txtmode);
+		FLEXT_CADDATTR_VAR1(c,"handles",handles);
 	}
 };
 
@@ -23,12 +23,22 @@ class ServiceWorker
 {
 public:
 	ServiceWorker(Symbol n,Symbol t,Symbol d,int p,int i,const std::string &txt)
-        : name(n),type(t),domain(d),interf(i),port(p),txtrec(txt)
+        : name(n),type(t),domain(d),interf(i),port(p),txtrec(txt),newtxtrec(txt)
 	{}
+
+	// to be called from main thread, the registration is updated in the worker thread (see Base::Poke)
+	void SetText(const std::string &txt)
+	{
+		txtmtx.Lock();
+		newtxtrec = txt;
+		txtmtx.Unlock();
+	}
 	
 protected:
 	typedef union { unsigned char b[2]; unsigned short NotAnInteger; } Opaque16;
 
+	virtual unsigned int Shard() const { return Hash(type,domain); }
+
 	virtual bool Init()
 	{
 		uint16_t PortAsNumber	= port;
@@ -37,7 +47,7 @@ protected:
 
 		DNSServiceErrorType err = DNSServiceRegister(
 			&client, 
-			0, // flags: default renaming behaviour 
+			Share(), // flags: default renaming behaviour 
             interf < 0?kDNSServiceInterfaceIndexLocalOnly:kDNSServiceInterfaceIndexAny, 
 			name?GetString(name):NULL,
 			GetString(type),
@@ -62,6 +72,34 @@ protected:
     int interf,port;
 	std::string txtrec;
 
+	// text record waiting to be applied
+	std::string newtxtrec;
+	ThrMutex txtmtx;
+
+	// update the registered text record in place, the service stays registered
+	virtual void OnPoke()
+	{
+		txtmtx.Lock();
+		std::string txt = newtxtrec;
+		txtmtx.Unlock();
+
+		if(txt == txtrec) return;
+
+		// an empty text record consists of a single empty string
+		DNSServiceErrorType err = DNSServiceUpdateRecord(
+			client,
+			NULL, // primary text record
+			0,
+			txt.length()?(uint16_t)txt.length():1, txt.length()?txt.data():"",
+			0 // default TTL
+		);
+
+		if(LIKELY(err == kDNSServiceErr_NoError))
+			txtrec = txt;
+		else
+			OnError(err);
+	}
+
 private:
     static void DNSSD_API callback(
         DNSServiceRef       sdRef, 
@@ -84,9 +122,9 @@ private:
 	void OnRegister(const char *name,const char *type,const char *domain)
     {
 		t_atom at[3];
-		SetString(at[0],name);
-		SetString(at[1],type);
-		SetString(at[2],DNSUnescape(domain).c_str());
+		SetSymbol(at[0],Intern(name,false));
+		SetSymbol(at[1],Intern(type,false));
+		SetSymbol(at[2],Intern(domain));
 		Message(sym_service,3,at);
     }
 };
@@ -99,6 +137,7 @@ public:
 
 	Service(int argc,const t_atom *argv)
 		: name(NULL),type(NULL),domain(NULL),interf(0),port(0)
+		, reinstall(false)
 	{		
 		if(argc >= 1) {
 			if(IsSymbol(*argv)) 
@@ -135,7 +174,7 @@ public:
 				throw "interface must be an int";
 			--argc,++argv;
 		}
-		Update();
+		Reinstall();
 	}
 
 	void ms_name(const AtomList &args)
@@ -152,7 +191,7 @@ public:
 
 		if(n != name) {
 			name = n;
-			Update();
+			Reinstall();
 		}
 	}
 
@@ -172,7 +211,7 @@ public:
 
 		if(t != type) {
 			type = t;
-			Update();
+			Reinstall();
 		}
 	}
 
@@ -192,7 +231,7 @@ public:
 
 		if(d != domain) {
 			domain = d;
-			Update();
+			Reinstall();
 		}
 	}
 	
@@ -202,7 +241,7 @@ public:
 	{
 		if(p != port) {
 			port = p;
-			Update();
+			Reinstall();
 		}
 	}
 
@@ -210,12 +249,12 @@ public:
 	{
 		if(i != interf) {
 			interf = i;
-			Update();
+			Reinstall();
 		}
 	}
 
 protected:
-	typedef std::map<Symbol,std::string> Textrecords;
+	typedef TxtRecords Textrecords;
 
 public:
 	void ms_txtrecord(int argc,const t_atom *argv)
@@ -227,41 +266,13 @@ public:
 				upd = true;
 			}
 		}
-		else if(IsSymbol(*argv)) {
-			Symbol key = GetSymbol(*argv++); --argc;
-			if(!argc) {
-				Textrecords::iterator it = txtrec.find(key);
-				if(it != txtrec.end()) {
-					txtrec.erase(it);
-					upd = true;
-				}
-			}
-			else {
-				std::string txt;
-				while(argc) {
-					if(IsString(*argv)) {
-						txt += GetString(*argv++);
-						--argc;
-						if(argc) txt += ' ';
-					}
-					else if(CanbeFloat(*argv)) {
-						char num[32];
-						sprintf(num,"%g",GetAFloat(*argv++));
-						--argc;
-						txt += num;
-						if(argc) txt += ' ';
-					}
-					else
-						++argv,--argc;
-				}
-				txtrec[key] = txt;
-				upd = true;
-			}
-		}
+		else if(IsSymbol(*argv))
+			upd = SetTxtRecord(txtrec,GetSymbol(*argv),argc-1,argv+1);
 		else
 			post("%s %s - textrecord key must be a symbol",thisName(),GetString(thisTag()));
 			
-		if(upd) Update();
+		// text record changes don't need a new registration
+		if(upd) Defer();
 	}
 
 	void mg_txtrecord(int argc,const t_atom *argv) 
@@ -294,31 +305,33 @@ protected:
 		ToQueueAnything(GetOutAttr(),sym_txtrecord,2,at);
 	}
 	
-	std::string makerec()
-	{
-		std::string ret;
-		for(Textrecords::const_iterator it = txtrec.begin(); it != txtrec.end(); ++it) {
-			const char *k = GetString(it->first);
-			size_t len = strlen(k)+1+it->second.length();
-			if(ret.length() > 255) {
-				post("txtrecord %s too long!",k);
-				continue;
-			}
-			ret += (char)(unsigned char)len;
-			ret += k;
-			ret += '=';
-			ret += it->second;
-		}
-		return ret;
-	}
+	std::string makerec() const { return MakeTxtRecord(txtrec); }
 
 	Symbol name,type,domain;
     int interf,port;
 	Textrecords txtrec;
 	
+	// a setting other than the text record has changed
+	bool reinstall;
+
+	void Reinstall()
+	{
+		reinstall = true;
+		Defer();
+	}
+
 	virtual void Update()
 	{
-        Install(type?new ServiceWorker(name,type,domain,port,interf,makerec()):NULL);
+		ServiceWorker *w = static_cast<ServiceWorker *>(Current());
+		if(reinstall || !w) {
+			reinstall = false;
+			Install(type?new ServiceWorker(name,type,domain,port,interf,makerec()):NULL);
+		}
+		else {
+			// update the text record of the running registration
+			w->SetText(makerec());
+			Poke(w);
+		}
 	}
 
 	FLEXT_CALLVAR_V(mg_name,ms_name)
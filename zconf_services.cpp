@@ -0,0 +1,337 @@
+/* 
+zconf - zeroconf networking objects
+
+Copyright (c)2006,2011 Thomas Grill (gr@grrrr.org)
+For information on usage and redistribution, and for a DISCLAIMER OF ALL
+WARRANTIES, see the file, "license.txt," in this distribution.  
+
+$LastChangedRevision$
+$LastChangedDate$
+$LastChangedBy$
+*/
+
+#include "zconf.h"
+
+namespace zconf {
+
+static Symbol sym_service;
+
+// description of one registration
+struct Registration
+{
+    Registration(): name(NULL),type(NULL),domain(NULL),port(0),interf(0) {}
+
+    Symbol name,type,domain;
+    int port,interf;
+    std::string txtrec;
+
+    // equal except for the text record
+    bool SameService(const Registration &r) const { return name == r.name && type == r.type && domain == r.domain && port == r.port && interf == r.interf; }
+};
+
+// many registrations as subordinates of one daemon connection
+class ServicesWorker
+	: public Worker
+{
+public:
+    // change for the registration key, a registration without type is removed
+    struct Change
+    {
+        Symbol key;
+        Registration reg;
+    };
+
+    // to be called from main thread, the changes are applied in the worker thread (see Base::Poke)
+    void Submit(std::vector<Change> &c)
+    {
+        changemtx.Lock();
+        changes.insert(changes.end(),c.begin(),c.end());
+        changemtx.Unlock();
+    }
+
+protected:
+	typedef union { unsigned char b[2]; unsigned short NotAnInteger; } Opaque16;
+
+	virtual bool Init()
+	{
+		// registrations are subordinates of conn
+		Share(true);
+		return conn && Worker::Init();
+	}
+
+	virtual void Close()
+	{
+        for(Entries::iterator it = entries.begin(); it != entries.end(); ++it)
+            if(it->second.client) DNSServiceRefDeallocate(it->second.client);
+        entries.clear();
+		Worker::Close();
+	}
+
+    // apply all submitted changes in one go
+	virtual void OnPoke()
+	{
+        std::vector<Change> c;
+        changemtx.Lock();
+        c.swap(changes);
+        changemtx.Unlock();
+
+        for(std::vector<Change>::const_iterator it = c.begin(); it != c.end(); ++it)
+            Apply(it->key,it->reg);
+	}
+
+private:
+    struct Entry
+    {
+        Entry(): worker(NULL),key(NULL),client(NULL) {}
+        ServicesWorker *worker;
+        Symbol key;
+        Registration reg;
+        DNSServiceRef client;
+    };
+
+    // the entries' addresses are the callback contexts, std::map keeps them stable
+    typedef std::map<Symbol,Entry> Entries;
+    Entries entries;
+
+    std::vector<Change> changes;
+    ThrMutex changemtx;
+
+    void Apply(Symbol key,const Registration &reg)
+    {
+        Entries::iterator it = entries.find(key);
+
+        if(!reg.type) {
+            // remove
+            if(it != entries.end()) {
+                if(it->second.client) DNSServiceRefDeallocate(it->second.client);
+                entries.erase(it);
+            }
+            return;
+        }
+
+        if(it != entries.end() && it->second.client && it->second.reg.SameService(reg)) {
+            // only the text record has changed, update it in place
+            Entry &e = it->second;
+            if(e.reg.txtrec == reg.txtrec) return;
+
+            // an empty text record consists of a single empty string
+            DNSServiceErrorType err = DNSServiceUpdateRecord(
+                e.client,
+                NULL, // primary text record
+                0,
+                reg.txtrec.length()?(uint16_t)reg.txtrec.length():1, reg.txtrec.length()?reg.txtrec.data():"",
+                0 // default TTL
+            );
+
+            if(LIKELY(err == kDNSServiceErr_NoError))
+                e.reg.txtrec = reg.txtrec;
+            else
+                OnServiceError(key,err);
+            return;
+        }
+
+        // new or changed service, register (again)
+        Entry &e = entries[key];
+        if(e.client) {
+            DNSServiceRefDeallocate(e.client);
+            e.client = NULL;
+        }
+        e.worker = this;
+        e.key = key;
+        e.reg = reg;
+
+		uint16_t PortAsNumber	= reg.port;
+		Opaque16 registerPort   = { { (unsigned char)(PortAsNumber >> 8), (unsigned char)(PortAsNumber & 0xFF) } };
+		int txtlen = (int)reg.txtrec.length();
+
+        e.client = conn;
+		DNSServiceErrorType err = DNSServiceRegister(
+			&e.client,
+			kDNSServiceFlagsShareConnection, // subordinate of conn, default renaming behaviour
+            reg.interf < 0?kDNSServiceInterfaceIndexLocalOnly:kDNSServiceInterfaceIndexAny,
+			reg.name?GetString(reg.name):NULL,
+			GetString(reg.type),
+			reg.domain?GetString(reg.domain):NULL,
+			NULL, // host
+			registerPort.NotAnInteger,
+			txtlen, txtlen?reg.txtrec.c_str():NULL,
+			(DNSServiceRegisterReply)&callback, &e
+		);
+
+		if(UNLIKELY(err != kDNSServiceErr_NoError)) {
+            e.client = NULL;
+			OnServiceError(key,err);
+		}
+    }
+
+    // error message tagged with the registration key
+    void OnServiceError(Symbol key,DNSServiceErrorType err)
+    {
+        tag = key;
+        Worker::OnError(err);
+        tag = NULL;
+    }
+
+    static void DNSSD_API callback(
+        DNSServiceRef       sdRef,
+        DNSServiceFlags     flags,
+        DNSServiceErrorType errorCode,
+        const char          *name,
+        const char          *regtype,
+        const char          *domain,
+        void                *context )
+	{
+        Entry *e = (Entry *)context;
+
+		if(LIKELY(errorCode == kDNSServiceErr_NoError))
+			e->worker->OnRegister(e->key,name,regtype,domain);
+		else
+			e->worker->OnServiceError(e->key,errorCode);
+	}
+
+	void OnRegister(Symbol key,const char *name,const char *type,const char *domain)
+    {
+		t_atom at[4];
+        SetSymbol(at[0],key);
+		SetSymbol(at[1],Intern(name,false));
+		SetSymbol(at[2],Intern(type,false));
+		SetSymbol(at[3],Intern(domain));
+		Message(sym_service,4,at);
+    }
+};
+
+class Services
+	: public Base
+{
+	FLEXT_HEADER_S(Services,Base,Setup)
+public:
+
+	Services()
+	{
+        Install(new ServicesWorker);
+    }
+
+    // add key type port [name] [domain] [interface]
+    // an existing registration is changed, its text record is kept
+    void m_add(int argc,const t_atom *argv)
+    {
+        if(argc < 3 || !IsSymbol(argv[0]) || !IsSymbol(argv[1]) || !CanbeInt(argv[2])) {
+			post("%s - add key type port [name] [domain] [interface]",thisName());
+            return;
+        }
+
+        Symbol key = GetSymbol(argv[0]);
+        Entry &s = services[key];
+        s.reg.type = GetSymbol(argv[1]);
+        s.reg.port = GetAInt(argv[2]);
+        s.reg.name = argc >= 4?GetASymbol(argv[3]):NULL;
+        s.reg.domain = argc >= 5?GetASymbol(argv[4]):NULL;
+        s.reg.interf = argc >= 6?GetAInt(argv[5]):0;
+        Changed(key);
+    }
+
+    // txtrecord key [entry [value...]]
+    void m_txtrecord(int argc,const t_atom *argv)
+    {
+        if(argc < 1 || !IsSymbol(argv[0]) || (argc >= 2 && !IsSymbol(argv[1]))) {
+			post("%s - txtrecord key [entry [value...]]",thisName());
+            return;
+        }
+
+        Symbol key = GetSymbol(argv[0]);
+        Entries::iterator it = services.find(key);
+        if(it == services.end()) {
+			post("%s - service %s not found",thisName(),GetString(key));
+            return;
+        }
+
+        bool upd;
+        if(argc == 1) {
+            upd = !it->second.txtrec.empty();
+            it->second.txtrec.clear();
+        }
+        else
+            upd = SetTxtRecord(it->second.txtrec,GetSymbol(argv[1]),argc-2,argv+2);
+
+        if(upd) Changed(key);
+    }
+
+    void m_remove(const t_symbol *key)
+    {
+        if(services.erase(key)) Changed(key);
+    }
+
+    void m_clear()
+    {
+        for(Entries::const_iterator it = services.begin(); it != services.end(); ++it)
+            changed.insert(it->first);
+        services.clear();
+        Defer();
+    }
+
+	void mg_count(int &c) const { c = (int)services.size(); }
+
+protected:
+
+    struct Entry
+    {
+        Registration reg;
+        TxtRecords txtrec;
+    };
+
+    typedef std::map<Symbol,Entry> Entries;
+    Entries services;
+
+    // keys changed since the last update
+    std::set<Symbol> changed;
+
+    void Changed(Symbol key)
+    {
+        changed.insert(key);
+        Defer();
+    }
+
+    // hand all changes to the worker as one batch
+	virtual void Update()
+	{
+        ServicesWorker *w = static_cast<ServicesWorker *>(Current());
+        if(!w || changed.empty()) return;
+
+        std::vector<ServicesWorker::Change> c(changed.size());
+        int i = 0;
+        for(std::set<Symbol>::const_iterator it = changed.begin(); it != changed.end(); ++it,++i) {
+            c[i].key = *it;
+            Entries::const_iterator sit = services.find(*it);
+            if(sit != services.end()) {
+                c[i].reg = sit->second.reg;
+                c[i].reg.txtrec = MakeTxtRecord(sit->second.txtrec);
+            }
+            // else no type: remove
+        }
+        changed.clear();
+
+        w->Submit(c);
+        Poke(w);
+	}
+
+	FLEXT_CALLBACK_V(m_add)
+	FLEXT_CALLBACK_V(m_txtrecord)
+	FLEXT_CALLBACK_S(m_remove)
+	FLEXT_CALLBACK(m_clear)
+	FLEXT_CALLGET_I(mg_count)
+
+	static void Setup(t_classid c)
+	{
+		sym_service = MakeSymbol("service");
+
+		FLEXT_CADDMETHOD_(c,0,"add",m_add);
+		FLEXT_CADDMETHOD_(c,0,"txtrecord",m_txtrecord);
+		FLEXT_CADDMETHOD_(c,0,"remove",m_remove);
+		FLEXT_CADDMETHOD_(c,0,"clear",m_clear);
+		FLEXT_CADDATTR_GET(c,"count",mg_count);
+	}
+};
+
+FLEXT_LIB("zconf.services, zconf",Services)
+
+} // namespace